@@ -0,0 +1,179 @@
+// compile with: g++ -std=c++11 -O3 generate_files.cpp -o generate_files `root-config --cflags --libs`
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <iostream>
+#include <sstream>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <getopt.h>  // getopt_long
+#include <ctype.h>  // isdigit
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "TFile.h"
+#include "TDirectory.h"
+#include "TH1D.h"
+#include "TH2D.h"
+#include "TH3D.h"
+#include "TRandom3.h"
+
+/* specify the expected options */
+static struct option long_options[] = {
+	{"help", no_argument, 0, 'h'},
+	{"files", required_argument, 0, 'n'},
+	{"output", required_argument, 0, 'o'},
+	{"histograms", required_argument, 0, 'H'},
+	{"dimensions", required_argument, 0, 'D'},
+	{"bins", required_argument, 0, 'b'},
+	{"depth", required_argument, 0, 'd'},
+	{"entries", required_argument, 0, 'e'},
+	{"compression", required_argument, 0, 'c'},
+	{"seed", required_argument, 0, 's'},
+	{0, 0, 0, 0}
+};
+
+void print_help(const char* name)
+{
+    const char* indent = "\t\t\t\t";
+    std::cerr << "Usage: " << name << " <option(s)> -o OUTPUT-DIR\n"
+              << "Write synthetic ROOT files with histograms to benchmark the merging\n"
+              << "Options:\n"
+              << "\t-h, --help\t\tShow this help message\n"
+              << "\t-o, --output DIR\tDirectory for the files, created if needed\n"
+              << "\t-n, --files N\t\tNumber of files (default: 100)\n"
+              << "\t-H, --histograms N\tHistograms per file (default: 100)\n"
+              << "\t-D, --dimensions N\t1, 2 or 3 dimensional histograms\n"
+              << indent << "(default: 1)\n"
+              << "\t-b, --bins N\t\tBins per axis (default: 100)\n"
+              << "\t-d, --depth N\t\tThe histograms are spread over N levels\n"
+              << indent << "of nested directories (default: 0)\n"
+              << "\t-e, --entries N\t\tEntries per histogram (default: 1000)\n"
+              << "\t-c, --compression N\tROOT compression settings, i. e.\n"
+              << indent << "algorithm*100 + level (default: 101)\n"
+              << "\t-s, --seed N\t\tSeed of the random numbers (default: 1)"
+              << std::endl;
+}
+
+static unsigned int is_udec(char* const str)
+{
+	char *p = &str[0];
+
+	while (*p)
+		if (!isdigit(*p++))
+			return 0;
+
+	return str[0];
+}
+
+int main(int argc, char** argv)
+{
+	opterr = 0;  // use own error messages instead of getopt buildin ones
+	int opt;
+	int option_index;
+	std::string output;
+	unsigned int files = 100, histograms = 100, dimensions = 1, bins = 100, depth = 0, entries = 1000;
+	int compression = 101;
+	unsigned int seed = 1;
+
+	while ((opt = getopt_long(argc, argv, "hn:o:H:D:b:d:e:c:s:", long_options, &option_index)) != -1) {
+		if (opt != 'h' && opt != 'o' && opt != '?' && !is_udec(optarg)) {
+			fprintf(stderr, "Invalid parameters: option '-%c' needs a non-negative integer\n", opt);
+			return EXIT_FAILURE;
+		}
+		switch (opt) {
+			case 'n':
+				files = atoi(optarg);
+				break;
+			case 'o':
+				output = optarg;
+				break;
+			case 'H':
+				histograms = atoi(optarg);
+				break;
+			case 'D':
+				dimensions = atoi(optarg);
+				break;
+			case 'b':
+				bins = atoi(optarg);
+				break;
+			case 'd':
+				depth = atoi(optarg);
+				break;
+			case 'e':
+				entries = atoi(optarg);
+				break;
+			case 'c':
+				compression = atoi(optarg);
+				break;
+			case 's':
+				seed = atoi(optarg);
+				break;
+			case 'h':
+				print_help(argv[0]);
+				return EXIT_SUCCESS;
+			case '?':
+			default:
+				fprintf(stderr, "%s: option '-%c' is invalid\n", argv[0], optopt);
+				print_help(argv[0]);
+				return EXIT_FAILURE;
+		}
+	}
+
+	if (output.empty()) {
+		fprintf(stderr, "You've specified no output directory!\n");
+		return EXIT_FAILURE;
+	}
+	if (dimensions < 1 || dimensions > 3 || !bins) {
+		fprintf(stderr, "Invalid parameters: the histograms need 1-3 dimensions and at least one bin\n");
+		return EXIT_FAILURE;
+	}
+	if (mkdir(output.c_str(), 0755) && errno != EEXIST) {
+		fprintf(stderr, "Unable to create the directory %s: %s\n", output.c_str(), strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	TH1::AddDirectory(kFALSE);
+	TRandom3 random(seed);
+	for (unsigned int f = 0; f < files; f++) {
+		std::ostringstream path;
+		path << output << "/file_" << f << ".root";
+		TFile file(path.str().c_str(), "RECREATE", "", compression);
+		if (!file.IsOpen()) {
+			fprintf(stderr, "Unable to write the file %s\n", path.str().c_str());
+			return EXIT_FAILURE;
+		}
+		// nested directories level_1/level_2/..., the histograms are distributed round robin over the levels
+		std::vector<TDirectory*> levels(1, &file);
+		for (unsigned int d = 1; d <= depth; d++) {
+			std::ostringstream name;
+			name << "level_" << d;
+			levels.push_back(levels.back()->mkdir(name.str().c_str()));
+		}
+		for (unsigned int i = 0; i < histograms; i++) {
+			std::ostringstream name;
+			name << "h" << i;
+			TH1* h;
+			if (dimensions == 1)
+				h = new TH1D(name.str().c_str(), name.str().c_str(), bins, -5, 5);
+			else if (dimensions == 2)
+				h = new TH2D(name.str().c_str(), name.str().c_str(), bins, -5, 5, bins, -5, 5);
+			else
+				h = new TH3D(name.str().c_str(), name.str().c_str(), bins, -5, 5, bins, -5, 5, bins, -5, 5);
+			for (unsigned int e = 0; e < entries; e++)
+				if (dimensions == 1)
+					h->Fill(random.Gaus());
+				else if (dimensions == 2)
+					static_cast<TH2*>(h)->Fill(random.Gaus(), random.Gaus());
+				else
+					static_cast<TH3*>(h)->Fill(random.Gaus(), random.Gaus(), random.Gaus());
+			levels[i % levels.size()]->WriteTObject(h);
+			delete h;
+		}
+		file.Close();
+	}
+	std::cout << files << " files written to " << output << std::endl;
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,121 @@
+#!/bin/sh
+# Generate synthetic ROOT files and measure how fast meh merges them, the results are written as JSON.
+#
+# Usage: run_benchmark.sh [options] [-- additional meh options]
+#   -m MEH        merge executable (default: ./meh)
+#   -g GENERATOR  generator executable, compiled from generate_files.cpp if missing (default: benchmark/generate_files)
+#   -w DIR        working directory for the input and output files (default: /tmp/meh_benchmark)
+#   -r FILE       JSON result file (default: standard output)
+#   -k            keep the input files of a previous run with the same working directory
+#   -n, -H, -D, -b, -d, -e, -c   passed to the generator: files, histograms per file, dimensions,
+#                 bins per axis, directory depth, entries per histogram, compression settings
+#
+# Example: benchmark/run_benchmark.sh -n 500 -H 200 -D 2 -r result.json -- -j 8
+
+set -e
+
+script_dir=$(cd "$(dirname "$0")" && pwd)
+meh=./meh
+generator="$script_dir/generate_files"
+work_dir=/tmp/meh_benchmark
+result=
+keep=0
+files=100
+histograms=100
+dimensions=1
+bins=100
+depth=0
+entries=1000
+compression=101
+
+while getopts "m:g:w:r:kn:H:D:b:d:e:c:" opt; do
+	case $opt in
+		m) meh=$OPTARG ;;
+		g) generator=$OPTARG ;;
+		w) work_dir=$OPTARG ;;
+		r) result=$OPTARG ;;
+		k) keep=1 ;;
+		n) files=$OPTARG ;;
+		H) histograms=$OPTARG ;;
+		D) dimensions=$OPTARG ;;
+		b) bins=$OPTARG ;;
+		d) depth=$OPTARG ;;
+		e) entries=$OPTARG ;;
+		c) compression=$OPTARG ;;
+		*) sed -n '2,14p' "$0" >&2; exit 1 ;;
+	esac
+done
+shift $((OPTIND - 1))
+[ "$1" = "--" ] && shift
+
+if [ ! -x "$generator" ]; then
+	echo "Compile the generator $generator" >&2
+	g++ -std=c++11 -O3 "$script_dir/generate_files.cpp" -o "$generator" $(root-config --cflags --libs)
+fi
+if [ ! -x /usr/bin/time ]; then
+	echo "/usr/bin/time is needed to measure the peak memory usage" >&2
+	exit 1
+fi
+
+input="$work_dir/input"
+output="$work_dir/merged.root"
+if [ $keep = 0 ] || [ ! -d "$input" ]; then
+	rm -rf "$input"
+	"$generator" -o "$input" -n "$files" -H "$histograms" -D "$dimensions" -b "$bins" -d "$depth" \
+		-e "$entries" -c "$compression" >&2
+fi
+input_bytes=$(du -sb "$input" | cut -f1)
+input_files=$(find "$input" -name '*.root' | wc -l)
+
+# wall time, user and system CPU time in seconds and the peak resident set size in kB
+"/usr/bin/time" -f '%e %U %S %M' -o "$work_dir/time.txt" \
+	"$meh" -d "$input" -o "$output" -p all "$@" > "$work_dir/meh.log" 2>&1 || {
+	echo "The merge failed, see $work_dir/meh.log" >&2
+	exit 1
+}
+read wall user sys rss < "$work_dir/time.txt"
+# the time spent writing the output is printed by meh: "Wrote X MB of objects compressed to Y MB in T s (...)"
+write=$(sed -n 's/^Wrote .* in \([0-9.e+-]*\) s .*/\1/p' "$work_dir/meh.log" | awk '{ s += $1 } END { print s + 0 }')
+
+# the strings are passed via the environment since awk -v interprets backslashes, and escaped for JSON
+json=$(ROOT_VERSION="$(root-config --version 2>/dev/null)" MEH_OPTIONS="$*" \
+	awk -v wall="$wall" -v user="$user" -v sys="$sys" -v rss="$rss" -v write="$write" \
+	-v files="$input_files" -v bytes="$input_bytes" -v histograms="$histograms" -v dimensions="$dimensions" \
+	-v bins="$bins" -v depth="$depth" -v entries="$entries" -v compression="$compression" '
+function json_escape(str,    out, i, c) {
+	out = ""
+	for (i = 1; i <= length(str); i++) {
+		c = substr(str, i, 1)
+		if (c == "\\" || c == "\"")
+			out = out "\\" c
+		else if (c == "\t")
+			out = out "\\t"
+		else if (c == "\n")
+			out = out "\\n"
+		else if (c == "\r")
+			out = out "\\r"
+		else
+			out = out c
+	}
+	return out
+}
+BEGIN {
+	printf "{\n"
+	printf "  \"root_version\": \"%s\",\n", json_escape(ENVIRON["ROOT_VERSION"])
+	printf "  \"meh_options\": \"%s\",\n", json_escape(ENVIRON["MEH_OPTIONS"])
+	printf "  \"input\": {\"files\": %d, \"bytes\": %.0f, \"histograms_per_file\": %d, \"dimensions\": %d, ", files, bytes, histograms, dimensions
+	printf "\"bins_per_axis\": %d, \"directory_depth\": %d, \"entries\": %d, \"compression\": %d},\n", bins, depth, entries, compression
+	printf "  \"wall_seconds\": %g,\n", wall
+	printf "  \"cpu_seconds\": %g,\n", user + sys
+	printf "  \"files_per_second\": %g,\n", (wall > 0 ? files/wall : 0)
+	printf "  \"mb_per_second\": %g,\n", (wall > 0 ? bytes/1e6/wall : 0)
+	printf "  \"phases\": {\"merge_seconds\": %g, \"write_seconds\": %g},\n", wall - write, write
+	printf "  \"peak_rss_kb\": %d\n", rss
+	printf "}\n"
+}')
+
+if [ -n "$result" ]; then
+	echo "$json" > "$result"
+else
+	echo "$json"
+fi
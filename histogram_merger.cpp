@@ -0,0 +1,3973 @@
+// the merging behind merge_histograms, see histogram_merger.h; compiled together with merge_histograms.cpp
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string.h>
+#include <vector>
+#include <list>
+#include <algorithm>
+#include <cmath>
+#include <exception>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/resource.h>  // getrusage
+#include <fcntl.h>  // open
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+//#include <sys/types.h>
+#include <deque>
+#include <map>
+#include <unordered_map>
+#include <set>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <regex>
+
+#include "TROOT.h"
+#include "TClass.h"
+#include "TFile.h"
+#include "TKey.h"
+#include "TH1.h"
+#include "TProfile.h"
+#include "TProfile2D.h"
+#include "TProfile3D.h"
+#include "TTree.h"
+#include "TTreeCloner.h"
+#include "TCollection.h"
+#include "TObjString.h"
+#include "TMD5.h"
+#include "TBufferFile.h"
+#include "TMemFile.h"
+#include "TVirtualStreamerInfo.h"
+#include "RZip.h"
+
+#include "histogram_merger.h"
+
+namespace {
+
+// the options of a merge which are needed by the reading and writing below, see HistogramMerger::Options
+struct Settings {
+	Settings() : verbose(false), sparse_ratio(0), compression(-1), write_threads(1) {}
+
+	bool verbose;
+	// histograms whose fraction of non-empty bins is below this ratio are summed up in a sparse form, 0 to disable it
+	double sparse_ratio;
+	int compression;  // compression of the written files as algorithm*100 + level, -1 to use the default of ROOT
+	unsigned int write_threads;  // threads which stream and compress the histograms before they are written
+};
+
+void remove_trailing_slash(std::string& path)
+{
+	while (!path.empty() && path.back() == '/')
+		path.pop_back();
+}
+
+void add_trailing_slash(std::string& path)
+{
+	if (!path.empty() && path.back() != '/')
+		path += '/';
+}
+
+const std::string join_path_str(const std::string path1, const std::string path2)
+{
+	std::string path(path1);
+	add_trailing_slash(path);
+	return path + path2;
+}
+
+std::string get_base_name(const std::string& str,
+                          const std::string& path_sep = "/\\")
+{
+	const size_t end = str.find_last_of(path_sep);
+	if (end == std::string::npos)
+		return str;  // no path given, return string
+
+	return str.substr(0, end);
+}
+
+// trim whitespaced at the beginning and the end of a string
+std::string trim(const std::string& str,
+                 const std::string& whitespace = " \t")
+{
+	const auto begin = str.find_first_not_of(whitespace);
+	if (begin == std::string::npos)
+		return "";  // no content
+
+	const auto end = str.find_last_not_of(whitespace);
+	const auto range = end - begin + 1;
+
+	return str.substr(begin, range);
+}
+
+// get the directory where the current program is located, empty if it can't be read
+std::string get_selfpath()
+{
+	char buf[PATH_MAX];
+	ssize_t len = readlink("/proc/self/exe", buf, sizeof(buf)-1);
+	if (len != -1) {
+		buf[len] = '\0';
+		std::string str(buf);
+		// remove program name from path
+		str = get_base_name(str);
+		return str;
+	} else {
+		std::cerr << "Unable to read the program path, relative paths are only looked up in the working directory: "
+			<< strerror(errno) << std::endl;
+		return std::string();
+	}
+}
+
+// the real path of a file, e. g. to compare the manifests of jobs with different working directories;
+// the path as it is if it can't be resolved, e. g. for inputs in memory or files which were removed
+std::string canonical_path(const std::string& path)
+{
+	char real[PATH_MAX];
+	return realpath(path.c_str(), real) ? std::string(real) : path;
+}
+
+// check if a file exists by opening and closing it
+int check_file(const char* name)
+{
+	FILE *f = NULL;
+	f = fopen(name, "r");
+	if (!f)
+		return 0;
+	fclose(f);
+	return 1;
+}
+
+// check if the class with the given name inherits from base without reading any object, the answer is cached
+// for every class name since the lookup is done for each key; unknown classes don't inherit from anything
+bool inherits_from(const char* class_name, const TClass* base)
+{
+	static std::map<std::pair<std::string, const TClass*>, bool> cache;
+	static std::mutex mutex;
+	std::lock_guard<std::mutex> lock(mutex);
+	auto it = cache.find(std::make_pair(std::string(class_name), base));
+	if (it != cache.end())
+		return it->second;
+	const TClass* cl = TClass::GetClass(class_name);
+	const bool inherits = cl && cl->InheritsFrom(base);
+	cache[std::make_pair(std::string(class_name), base)] = inherits;
+	return inherits;
+}
+
+bool is_directory_key(const TKey* key)
+{
+	return inherits_from(key->GetClassName(), TDirectory::Class());
+}
+
+// collect the top level directories of a file using the keys only
+void get_list_of_directories(std::list<TKey*>& list, TDirectory* dir)
+{
+	TIter next(dir->GetListOfKeys());
+	while (TKey* key = static_cast<TKey*>(next()))
+		if (is_directory_key(key))
+			list.push_back(key);
+}
+
+// collect the keys of the objects of the given class in a directory and its subdirectories together with their
+// full paths starting with prefix; only the class names stored in the keys are used, no object is read
+void get_list_of_objects(std::list<std::pair<std::string, TKey*>>& list, TDirectory* dir, const TClass* base,
+                         const std::string& prefix = "")
+{
+	TIter next(dir->GetListOfKeys());
+	while (TKey* key = static_cast<TKey*>(next())) {
+		if (inherits_from(key->GetClassName(), base))
+			list.push_back(std::make_pair(prefix + key->GetName(), key));
+		else if (is_directory_key(key)) {
+			TDirectory* subdir = dir->GetDirectory(key->GetName());
+			if (subdir)
+				get_list_of_objects(list, subdir, base, prefix + key->GetName() + '/');
+		}
+	}
+}
+
+void get_list_of_histograms(std::list<std::pair<std::string, TKey*>>& list, TDirectory* dir, const std::string& prefix = "")
+{
+	get_list_of_objects(list, dir, TH1::Class(), prefix);
+}
+
+// glob patterns like "TaggerE_*" or regular expressions with the prefix "re:" which are compiled once; a pattern
+// which contains a slash is matched against the full path of a histogram, otherwise against its name alone
+class PathPatterns {
+public:
+	// returns false if the regular expression is invalid
+	bool add(const std::string& pattern)
+	{
+		Pattern compiled;
+		compiled.full_path = pattern.find('/') != std::string::npos;
+		compiled.search = !pattern.compare(0, 3, "re:");
+		try {
+			compiled.regex = std::regex(compiled.search ? pattern.substr(3) : glob_to_regex(pattern),
+				std::regex::ECMAScript | std::regex::optimize);
+		} catch (const std::regex_error& e) {
+			std::cerr << "Invalid pattern '" << pattern << "': " << e.what() << std::endl;
+			return false;
+		}
+		patterns_.push_back(compiled);
+		return true;
+	}
+
+	// true if any of the patterns matches the path
+	bool matches(const std::string& path) const
+	{
+		const size_t slash = path.rfind('/');
+		const std::string name = slash == std::string::npos ? path : path.substr(slash + 1);
+		for (auto& pattern : patterns_) {
+			const std::string& str = pattern.full_path ? path : name;
+			if (pattern.search ? std::regex_search(str, pattern.regex) : std::regex_match(str, pattern.regex))
+				return true;
+		}
+		return false;
+	}
+
+	bool empty() const
+	{
+		return patterns_.empty();
+	}
+
+private:
+	struct Pattern {
+		std::regex regex;
+		bool full_path;
+		bool search;  // a regular expression matches anywhere unless it's anchored, a glob the whole string
+	};
+
+	// *, ? and [...] don't match a slash, i. e. they stay within a directory
+	static std::string glob_to_regex(const std::string& glob)
+	{
+		std::string regex;
+		for (size_t i = 0; i < glob.size(); i++) {
+			const char c = glob[i];
+			if (c == '*')
+				regex += "[^/]*";
+			else if (c == '?')
+				regex += "[^/]";
+			else if (c == '[' && glob.find(']', i + 2) != std::string::npos) {  // a set like [0-9] or [!_]
+				const size_t end = glob.find(']', i + 2);
+				regex += '[';
+				for (size_t j = i + 1; j < end; j++) {
+					if (j == i + 1 && glob[j] == '!')
+						regex += '^';
+					else {
+						if (strchr("\\[]^", glob[j]))
+							regex += '\\';
+						regex += glob[j];
+					}
+				}
+				regex += ']';
+				i = end;
+			} else {
+				if (strchr("\\^$.|+()[]{}", c))
+					regex += '\\';
+				regex += c;
+			}
+		}
+		return regex;
+	}
+
+	std::vector<Pattern> patterns_;
+};
+
+// number of files which are merged by one thread into a partial sum before it is handed to the reduction,
+// it doesn't depend on the number of threads in order to get the same result for every thread count
+static const size_t parallel_chunk_size = 8;
+
+// thread-safe FIFO queue which hands out its items in consecutively numbered chunks
+template <typename T>
+class WorkQueue {
+public:
+	WorkQueue() : closed_(false), next_sequence_(0) {}
+
+	void push(const T& item)
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		items_.push_back(item);
+		cond_.notify_all();
+	}
+
+	// signal that no more items will be pushed
+	void close()
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		closed_ = true;
+		cond_.notify_all();
+	}
+
+	// wait until max_size items are available or the queue is closed and take them,
+	// the chunk number is stored in sequence, returns false if the queue is closed and drained
+	bool pop_chunk(std::vector<T>& chunk, size_t max_size, size_t& sequence)
+	{
+		std::unique_lock<std::mutex> lock(mutex_);
+		cond_.wait(lock, [this, max_size]{ return closed_ || items_.size() >= max_size; });
+		if (items_.empty())
+			return false;
+		chunk.clear();
+		while (!items_.empty() && chunk.size() < max_size) {
+			chunk.push_back(items_.front());
+			items_.pop_front();
+		}
+		sequence = next_sequence_++;
+		return true;
+	}
+
+	// wait until the first item is available and get a copy of it, returns false if the queue stays empty
+	bool wait_first(T& item)
+	{
+		std::unique_lock<std::mutex> lock(mutex_);
+		cond_.wait(lock, [this]{ return closed_ || !items_.empty(); });
+		if (items_.empty())
+			return false;
+		item = items_.front();
+		return true;
+	}
+
+private:
+	std::deque<T> items_;
+	std::mutex mutex_;
+	std::condition_variable cond_;
+	bool closed_;
+	size_t next_sequence_;
+};
+
+// number of threads which scan a directory tree for files
+static const unsigned int scan_threads = 8;
+// number of threads which check the integrity of the files before they are merged
+static const unsigned int check_threads = 8;
+// while watching a directory, files found by a scan are only taken if they weren't modified for this many seconds,
+// otherwise they're expected to be still written and are taken when they're closed or settled
+static const int watch_settle_seconds = 5;
+
+// the class name of every key in a file by its full path, read by the integrity check
+typedef std::map<std::string, std::string> FileLayout;
+
+// a record read from a file with accessors for its big-endian fields,
+// reading beyond its end yields zeros and sets the overflow flag
+class RecordBuffer {
+public:
+	RecordBuffer() : pos_(0), overflow_(false) {}
+
+	// read size bytes at offset, false if the file is shorter
+	bool read(const int fd, const long long offset, const size_t size)
+	{
+		data_.resize(size);
+		pos_ = 0;
+		overflow_ = false;
+		return size && pread(fd, &data_[0], size, offset) == (ssize_t)size;
+	}
+
+	long long number(const size_t bytes)
+	{
+		if (pos_ + bytes > data_.size()) {
+			overflow_ = true;
+			return 0;
+		}
+		long long value = 0;
+		for (size_t i = 0; i < bytes; i++)
+			value = value << 8 | (unsigned char)data_[pos_++];
+		return value;
+	}
+
+	// strings are stored with a one byte length, or 255 followed by a four byte length
+	std::string string()
+	{
+		size_t length = number(1);
+		if (length == 255)
+			length = number(4);
+		if (pos_ + length > data_.size()) {
+			overflow_ = true;
+			return std::string();
+		}
+		std::string str(&data_[pos_], length);
+		pos_ += length;
+		return str;
+	}
+
+	void skip(const size_t bytes)
+	{
+		pos_ += bytes;
+	}
+
+	void seek(const size_t pos)
+	{
+		pos_ = pos;
+	}
+
+	size_t position() const
+	{
+		return pos_;
+	}
+
+	bool overflow() const
+	{
+		return overflow_ || pos_ > data_.size();
+	}
+
+private:
+	std::vector<char> data_;
+	size_t pos_;
+	bool overflow_;
+};
+
+struct KeyHeader {
+	long long nbytes;
+	size_t keylen;
+	long long seek;
+	std::string class_name;
+	std::string name;
+};
+
+// the header of a key as written by TKey::FillBuffer, large files use 64 bit positions
+bool read_key_header(RecordBuffer& buffer, KeyHeader& key)
+{
+	const size_t start = buffer.position();
+	key.nbytes = buffer.number(4);
+	const int version = buffer.number(2);
+	buffer.skip(4 + 4);  // object length, date
+	key.keylen = buffer.number(2);
+	buffer.skip(2);  // cycle
+	const size_t seek_size = version > 1000 ? 8 : 4;
+	key.seek = buffer.number(seek_size);
+	buffer.skip(seek_size);  // parent directory
+	key.class_name = buffer.string();
+	key.name = buffer.string();
+	buffer.string();  // title
+	if (buffer.overflow() || buffer.position() > start + key.keylen)
+		return false;
+	buffer.seek(start + key.keylen);
+	return true;
+}
+
+// check the directory whose header is stored at offset in a file of the given size and all its subdirectories:
+// the key list has to exist and every key has to be inside the file; the keys are added to the layout
+bool check_directory(const int fd, const long long offset, const long long end, const std::string& prefix,
+                     FileLayout& layout, std::string& reason, const int depth = 0)
+{
+	const std::string name = prefix.empty() ? std::string("the top directory") : "the directory " + prefix;
+	RecordBuffer buffer;
+	// version, two dates, sizes of the key list and the name, three positions of 4 or 8 bytes
+	if (depth > 100 || offset >= end || !buffer.read(fd, offset, std::min(42LL, end - offset))) {
+		reason = "the header of " + name + " is corrupt";
+		return false;
+	}
+	const int version = buffer.number(2);
+	buffer.skip(4 + 4);  // dates
+	const long long nbytes_keys = buffer.number(4);
+	buffer.skip(4);  // size of the name
+	const size_t seek_size = version > 1000 ? 8 : 4;
+	buffer.skip(2*seek_size);  // this directory and its parent
+	const long long seek_keys = buffer.number(seek_size);
+	if (buffer.overflow()) {
+		reason = "the header of " + name + " is corrupt";
+		return false;
+	}
+	// the key list is written when the file is closed
+	if (!seek_keys || nbytes_keys <= 0) {
+		reason = "the key list of " + name + " is missing, the file wasn't closed properly";
+		return false;
+	}
+	if (seek_keys + nbytes_keys > end || !buffer.read(fd, seek_keys, nbytes_keys)) {
+		reason = "the key list of " + name + " is beyond the end of the file";
+		return false;
+	}
+	// the key list is a key itself, followed by the number of keys and their headers
+	KeyHeader key;
+	if (!read_key_header(buffer, key)) {
+		reason = "the key list of " + name + " is corrupt";
+		return false;
+	}
+	const long long nkeys = buffer.number(4);
+	for (long long i = 0; i < nkeys; i++) {
+		if (!read_key_header(buffer, key)) {
+			reason = "the key list of " + name + " is corrupt";
+			return false;
+		}
+		const std::string path = prefix + key.name;
+		if (key.seek <= 0 || key.nbytes <= 0 || key.seek + key.nbytes > end) {
+			reason = "the key " + path + " is beyond the end of the file";
+			return false;
+		}
+		layout[path] = key.class_name;
+		if ((key.class_name == "TDirectoryFile" || key.class_name == "TDirectory")
+				&& !check_directory(fd, key.seek + key.keylen, end, path + '/', layout, reason, depth + 1))
+			return false;
+	}
+	return true;
+}
+
+// check the integrity of a file by reading its metadata only, without TFile which would try a slow recovery:
+// the header, the end of the file stored in it, which mustn't be behind the actual end, and the key lists of all directories; the layout is filled
+bool check_integrity(const std::string& path, FileLayout& layout, std::string& reason)
+{
+	const int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0) {
+		reason = strerror(errno);
+		return false;
+	}
+	struct stat st;
+	RecordBuffer header;
+	bool good = false;
+	if (fstat(fd, &st))
+		reason = strerror(errno);
+	// magic number, version, begin, then end of the file, free segments, size of the name, units,
+	// compression and streamer info, the positions have 8 bytes for large files
+	else if (!header.read(fd, 0, std::min(64LL, (long long)st.st_size)) || header.number(4) != 0x726f6f74)  // "root"
+		reason = "no ROOT file";
+	else {
+		const long long version = header.number(4);
+		const long long begin = header.number(4);
+		const size_t seek_size = version >= 1000000 ? 8 : 4;
+		const long long end = header.number(seek_size);
+		const long long seek_free = header.number(seek_size);
+		const long long nbytes_free = header.number(4);
+		header.skip(4);  // number of free segments
+		const long long nbytes_name = header.number(4);
+		header.skip(1 + 4);  // units, compression
+		const long long seek_info = header.number(seek_size);
+		const long long nbytes_info = header.number(4);
+		if (header.overflow() || begin <= 0 || nbytes_name <= 0)
+			reason = "the header is corrupt";
+		else if (end > st.st_size)
+			reason = "the file is truncated, it ends at " + std::to_string((long long)st.st_size)
+				+ " bytes instead of " + std::to_string(end);
+		else if (seek_free + nbytes_free > end || seek_info + nbytes_info > end)
+			reason = "the list of free segments or the streamer info is beyond the end of the file";
+		else
+			good = check_directory(fd, begin + nbytes_name, end, "", layout, reason);
+	}
+	close(fd);
+	return good;
+}
+
+// every histogram of the reference has to exist in the layout with the same class, additional keys are fine
+bool matches_layout(const FileLayout& reference, const FileLayout& layout, std::string& reason)
+{
+	for (auto& key : reference) {
+		auto it = layout.find(key.first);
+		if (it == layout.end()) {
+			reason = key.first + " is missing";
+			return false;
+		}
+		if (it->second != key.second) {
+			reason = key.first + " is a " + it->second + " instead of a " + key.second;
+			return false;
+		}
+	}
+	return true;
+}
+
+/* Set by HistogramMerger::stop() to stop watching for new files. */
+static volatile sig_atomic_t stop_requested = 0;
+
+// parse a weight, it has to be a finite, non-negative number without anything else
+bool parse_weight(const std::string& str, double& weight)
+{
+	char* end;
+	errno = 0;
+	weight = strtod(str.c_str(), &end);
+	return !str.empty() && !*end && !errno && std::isfinite(weight) && weight >= 0;
+}
+
+// weights of the inputs by their path, the histograms of a file are scaled by its weight when they're added;
+// files without a weight have the weight 1
+class FileWeights {
+public:
+	// the weight has to be set before the file is pushed into the merge queue
+	void set(const std::string& path, const double weight)
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		weights_[path] = weight;
+		char real[PATH_MAX];
+		if (realpath(path.c_str(), real))
+			weights_[real] = weight;
+	}
+
+	// the file is looked up by the given path and by its real path, e. g. if the list contains relative paths
+	double get(const std::string& path) const
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (weights_.empty())
+			return 1;
+		auto it = weights_.find(path);
+		char real[PATH_MAX];
+		if (it == weights_.end() && realpath(path.c_str(), real))
+			it = weights_.find(real);
+		return it == weights_.end() ? 1 : it->second;
+	}
+
+	// read a CSV file with the path and the weight in every line, a header line and lines starting with # are skipped
+	bool read_csv(const std::string& csv)
+	{
+		std::ifstream in(csv.c_str());
+		if (!in) {
+			std::cerr << "Unable to read the weights from '" << csv << "': " << strerror(errno) << std::endl;
+			return false;
+		}
+		std::string line;
+		for (size_t n = 1; std::getline(in, line); n++) {
+			line = trim(line, " \t\r");
+			if (line.empty() || line[0] == '#')
+				continue;
+			const size_t comma = line.rfind(',');
+			double weight;
+			if (comma == std::string::npos || !parse_weight(trim(line.substr(comma + 1), " \t\""), weight)) {
+				if (n == 1)  // header
+					continue;
+				std::cerr << "Invalid weight in line " << n << " of '" << csv << "': " << line << std::endl;
+				return false;
+			}
+			set(trim(line.substr(0, comma), " \t\""), weight);
+		}
+		return true;
+	}
+
+private:
+	std::map<std::string, double> weights_;
+	mutable std::mutex mutex_;
+};
+
+// assigns the files to groups which are merged into outputs of their own, the group is given by a column of the
+// list or as the first capture of a regular expression on the path; the groups are numbered from 1 as they're found
+class FileGroups {
+public:
+	FileGroups() : names_(1), use_regex_(false) {}
+
+	// returns false if the regular expression is invalid
+	bool set_regex(const std::string& regex)
+	{
+		try {
+			regex_ = std::regex(regex, std::regex::ECMAScript | std::regex::optimize);
+		} catch (const std::regex_error& e) {
+			std::cerr << "Invalid group pattern '" << regex << "': " << e.what() << std::endl;
+			return false;
+		}
+		use_regex_ = true;
+		return true;
+	}
+
+	// the group has to be set before the file is pushed into the merge queue, it takes precedence over the regex
+	void set(const std::string& path, const std::string& group)
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		number(group);
+		groups_[path] = group;
+		char real[PATH_MAX];
+		if (realpath(path.c_str(), real))
+			groups_[real] = group;
+	}
+
+	// the number of the group of a file, 0 if it belongs to none
+	size_t get(const std::string& path)
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		auto it = groups_.find(path);
+		char real[PATH_MAX];
+		if (it == groups_.end() && !groups_.empty() && realpath(path.c_str(), real))
+			it = groups_.find(real);
+		if (it != groups_.end())
+			return number(it->second);
+		std::smatch match;
+		if (!use_regex_ || !std::regex_search(path, match, regex_))
+			return 0;
+		return number(match.size() > 1 ? match[1].str() : match[0].str());
+	}
+
+	// the names of the groups by their number, the first one is empty
+	std::vector<std::string> names() const
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		return names_;
+	}
+
+private:
+	size_t number(const std::string& group)
+	{
+		auto it = numbers_.find(group);
+		if (it != numbers_.end())
+			return it->second;
+		numbers_[group] = names_.size();
+		names_.push_back(group);
+		return names_.size() - 1;
+	}
+
+	std::map<std::string, std::string> groups_;  // by path
+	std::map<std::string, size_t> numbers_;
+	std::vector<std::string> names_;
+	std::regex regex_;
+	bool use_regex_;
+	mutable std::mutex mutex_;
+};
+
+// collects the input files in the background and pushes them into the merge queue as soon as they are found,
+// the queue is closed when all files are found
+class FileSource {
+public:
+	FileSource(WorkQueue<std::string>& queue, const std::string& extension, const Settings& settings)
+		: queue_(queue), extension_(extension), settings_(settings), weights_(NULL), groups_(NULL), producers_(1), quarantine_(NULL), running_checks_(0),
+		  have_reference_(false), check_all_(true), check_patterns_(NULL), check_exclusions_(NULL), checked_(0), pending_dirs_(0), inotify_fd_(-1), stopped_(false) {}
+
+	// the merge might have failed before the watching was stopped, otherwise this would wait forever
+	~FileSource()
+	{
+		stop();
+		wait();
+		if (inotify_fd_ >= 0)
+			close(inotify_fd_);
+		if (quarantine_)
+			fclose(quarantine_);
+	}
+
+	// check the integrity of every file in several threads before it's pushed into the queue, see check_integrity;
+	// the first good file in the order they were found is the reference, the others have to contain the histograms
+	// of it which are selected with the same classes, all if all is set; files which fail are skipped and their paths
+	// are appended to the file quarantine; has to be called before the files are collected
+	bool check(const std::string& quarantine, const bool all, const std::vector<std::string>& names,
+	           const PathPatterns* patterns, const PathPatterns* exclusions)
+	{
+		check_all_ = all;
+		check_names_ = names;
+		check_patterns_ = patterns;
+		check_exclusions_ = exclusions;
+		quarantine_ = fopen(quarantine.c_str(), "w");
+		if (!quarantine_) {
+			fprintf(stderr, "Unable to write the quarantine list '%s': %s\n", quarantine.c_str(), strerror(errno));
+			return false;
+		}
+		running_checks_ = check_threads;
+		for (unsigned int i = 0; i < check_threads; i++)
+			threads_.push_back(std::thread(&FileSource::check_files, this));
+		return true;
+	}
+
+	// recursively scan directories with several threads, every file is taken only once even if it
+	// can be reached via different paths, the order of the files is unspecified; can only be called once;
+	// if watch is set, new files are taken when they're closed after writing until stop_requested is set
+	bool scan_directories(const std::vector<std::string>& paths, const bool watch = false)
+	{
+		for (auto& path : paths) {
+			struct stat st;
+			if (stat(path.c_str(), &st)) {
+				fprintf(stderr, "The directory '%s' could not be read!\n", path.c_str());
+				return false;
+			}
+			if (first_visit(st.st_dev, st.st_ino))
+				dirs_.push_back(path);
+		}
+		if (watch) {
+			inotify_fd_ = inotify_init();
+			if (inotify_fd_ < 0) {
+				fprintf(stderr, "Unable to watch the directories: %s\n", strerror(errno));
+				return false;
+			}
+		}
+		producers_++;
+		pending_dirs_ = dirs_.size();
+		for (unsigned int i = 0; i < scan_threads; i++)
+			threads_.push_back(std::thread(&FileSource::walk, this));
+		if (watch)
+			threads_.push_back(std::thread(&FileSource::watch_events, this));
+		return true;
+	}
+
+	// read the files line by line from a list, use "-" to read the list from the standard input,
+	// relative paths are looked up in the working directory and the directory of the program;
+	// a number separated by whitespace after the path is the weight of the file
+	void read_list(const std::string& list)
+	{
+		producers_++;
+		threads_.push_back(std::thread(&FileSource::read, this, list));
+	}
+
+	// take the given files as they are, unchecked is set for inputs which aren't files, e. g. in memory
+	void add_paths(const std::vector<std::string>& paths, const bool unchecked = false)
+	{
+		producers_++;
+		for (auto& path : paths) {
+			if (unchecked && !skip_.count(canonical_path(path)))
+				accept(path);
+			else if (!unchecked && first_visit(path))
+				add(path);
+			else if (!unchecked)
+				printf("WARNING: The file '%s' was given already, skip it\n", path.c_str());
+		}
+		finish();
+	}
+
+	// all sources are added, the queue is closed as soon as they're read
+	void no_more_sources()
+	{
+		finish();
+	}
+
+	// stop watching for new files, e. g. if the merge failed
+	void stop()
+	{
+		stopped_ = true;
+	}
+
+	// wait until all files are found
+	void wait()
+	{
+		for (auto& thread : threads_)
+			thread.join();
+		threads_.clear();
+	}
+
+	// the weights given in a list are stored in these, has to be set before the files are collected
+	void set_weights(FileWeights* weights)
+	{
+		weights_ = weights;
+	}
+
+	// if set, the last column of a list is the group of the file, has to be set before the files are collected
+	void set_groups(FileGroups* groups)
+	{
+		groups_ = groups;
+	}
+
+	// files which shouldn't be pushed into the queue, has to be set before the files are collected;
+	// they're compared by their real path
+	void skip(const std::set<std::string>& paths)
+	{
+		for (auto& path : paths)
+			skip_.insert(canonical_path(path));
+	}
+
+	// all files found so far in the order they were pushed into the queue
+	std::vector<std::string> files()
+	{
+		std::lock_guard<std::mutex> lock(files_mutex_);
+		return files_;
+	}
+
+	// files which failed the integrity check
+	std::vector<std::string> quarantined()
+	{
+		std::lock_guard<std::mutex> lock(files_mutex_);
+		return quarantined_;
+	}
+
+	// when the last file was found, valid after wait()
+	const std::chrono::steady_clock::time_point& finished() const
+	{
+		return finished_;
+	}
+
+	// when the file was found, i. e. closed after writing while watching a directory, by its real path as in the
+	// manifest; forgets about the file
+	bool take_found_time(const std::string& path, std::chrono::steady_clock::time_point& time)
+	{
+		std::lock_guard<std::mutex> lock(files_mutex_);
+		auto it = found_.find(path);
+		if (it == found_.end())
+			return false;
+		time = it->second;
+		found_.erase(it);
+		return true;
+	}
+
+private:
+	void add(const std::string& path)
+	{
+		if (!skip_.empty() && skip_.count(canonical_path(path)))
+			return;
+		if (inotify_fd_ >= 0) {
+			std::lock_guard<std::mutex> lock(files_mutex_);
+			found_[canonical_path(path)] = std::chrono::steady_clock::now();
+		}
+		if (settings_.verbose)
+			printf("Found file %s\n", path.c_str());
+		if (quarantine_)
+			unchecked_.push(path);
+		else
+			accept(path);
+	}
+
+	void accept(const std::string& path)
+	{
+		std::lock_guard<std::mutex> lock(files_mutex_);
+		files_.push_back(path);
+		queue_.push(path);
+	}
+
+	void reject(const std::string& path, const std::string& reason)
+	{
+		std::lock_guard<std::mutex> lock(files_mutex_);
+		quarantined_.push_back(path);
+		found_.erase(canonical_path(path));
+		printf("WARNING: The file '%s' is skipped, %s\n", path.c_str(), reason.c_str());
+		fprintf(quarantine_, "%s\n", path.c_str());
+		fflush(quarantine_);  // complete even if the merge crashes
+	}
+
+	// take files from the unchecked ones until all are checked, the last thread closes the queue
+	void check_files()
+	{
+		std::vector<std::string> chunk;
+		size_t sequence;
+		while (unchecked_.pop_chunk(chunk, 1, sequence)) {
+			const std::string& path = chunk.front();
+			FileLayout layout;
+			std::string reason;
+			bool good = check_integrity(path, layout, reason);
+			std::unique_lock<std::mutex> lock(reference_mutex_);
+			if (!have_reference_) {  // the files wait until all files found before them are checked
+				if (good)
+					candidates_[sequence] = std::make_pair(path, std::move(layout));
+				else {
+					failed_.insert(sequence);
+					reject(path, reason);
+				}
+				choose_reference();
+				continue;
+			}
+			lock.unlock();
+			if (good)
+				good = matches_layout(reference_, layout, reason);
+			if (good)
+				accept(path);
+			else
+				reject(path, reason);
+		}
+		std::lock_guard<std::mutex> lock(files_mutex_);
+		if (!--running_checks_) {
+			finished_ = std::chrono::steady_clock::now();
+			queue_.close();
+		}
+	}
+
+	// the histograms of the reference which will be merged: the ones selected by their path, by their name
+	// in which case the one closest to the top is taken as by KeyIndex::resolve, or by a pattern, except for
+	// the excluded ones
+	bool selected(const std::string& path, const FileLayout& histograms) const
+	{
+		if (check_exclusions_ && check_exclusions_->matches(path))
+			return false;
+		if (check_all_ || (check_patterns_ && check_patterns_->matches(path)))
+			return true;
+		const size_t slash = path.rfind('/');
+		const std::string name = slash == std::string::npos ? path : path.substr(slash + 1);
+		const long depth = std::count(path.begin(), path.end(), '/');
+		for (auto& wanted : check_names_) {
+			if (wanted == path)
+				return true;
+			if (wanted != name || histograms.count(wanted))
+				continue;
+			// a histogram with the same name closer to the top is taken instead
+			bool closest = true;
+			for (auto& other : histograms) {
+				const size_t other_slash = other.first.rfind('/');
+				if (other_slash != std::string::npos && !other.first.compare(other_slash + 1, std::string::npos, name)
+						&& std::count(other.first.begin(), other.first.end(), '/') < depth) {
+					closest = false;
+					break;
+				}
+			}
+			if (closest)
+				return true;
+		}
+		return false;
+	}
+
+	// the reference is the first good file in the order the files were found, hence it doesn't depend on which
+	// check finishes first; it's the first file in the queue, the histograms are taken from it; only the
+	// selected histograms are compared; has to be called with reference_mutex_ locked
+	void choose_reference()
+	{
+		while (failed_.count(checked_))
+			failed_.erase(checked_++);
+		auto first = candidates_.find(checked_);
+		if (first == candidates_.end())
+			return;
+		FileLayout histograms;
+		for (auto& key : first->second.second)
+			if (inherits_from(key.second.c_str(), TH1::Class()))
+				histograms.insert(key);
+		for (auto& key : histograms)
+			if (selected(key.first, histograms))
+				reference_.insert(key);
+		have_reference_ = true;
+		accept(first->second.first);
+		candidates_.erase(first);
+		for (auto& candidate : candidates_) {
+			std::string reason;
+			if (matches_layout(reference_, candidate.second.second, reason))
+				accept(candidate.second.first);
+			else
+				reject(candidate.second.first, reason);
+		}
+		candidates_.clear();
+		failed_.clear();
+	}
+
+	bool has_extension(const char* name) const
+	{
+		const size_t length = strlen(name);
+		return length >= extension_.length() && !strcmp(name + length - extension_.length(), extension_.c_str());
+	}
+
+	// returns false if the file or directory was already seen
+	bool first_visit(const dev_t device, const ino_t inode)
+	{
+		std::lock_guard<std::mutex> lock(dirs_mutex_);
+		return seen_.insert(std::make_pair(device, inode)).second;
+	}
+
+	// the same for a file given by its path, e. g. in several lists or in a directory which is scanned as well;
+	// a file which can't be found is taken, opening it fails later
+	bool first_visit(const std::string& path)
+	{
+		struct stat st;
+		return stat(path.c_str(), &st) || first_visit(st.st_dev, st.st_ino);
+	}
+
+	// take a file found by a scan, while watching recently modified files are deferred
+	void add_scanned(const std::string& path, const struct stat& st)
+	{
+		if (inotify_fd_ >= 0 && time(NULL) - st.st_mtime < watch_settle_seconds) {
+			std::lock_guard<std::mutex> lock(dirs_mutex_);
+			unsettled_.insert(path);
+		} else if (first_visit(st.st_dev, st.st_ino))
+			add(path);
+	}
+
+	// take directories from the list until the whole tree is scanned
+	void walk()
+	{
+		std::unique_lock<std::mutex> lock(dirs_mutex_);
+		while (1) {
+			dirs_cond_.wait(lock, [this]{ return !dirs_.empty() || !pending_dirs_; });
+			if (dirs_.empty())
+				break;
+			std::string path = dirs_.front();
+			dirs_.pop_front();
+			lock.unlock();
+			scan(path);
+			lock.lock();
+			if (!--pending_dirs_) {  // the last directory is done, nothing will be added anymore
+				if (inotify_fd_ < 0)
+					finish();
+				dirs_cond_.notify_all();
+			}
+		}
+	}
+
+	// the subdirectories are handed over to the walkers, or appended to subdirs if given
+	void scan(const std::string& path, std::deque<std::string>* subdirs = NULL)
+	{
+		// watch before reading the directory, otherwise files closed in between would be missed
+		if (inotify_fd_ >= 0) {
+			int wd = inotify_add_watch(inotify_fd_, path.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_ONLYDIR);
+			if (wd < 0)
+				fprintf(stderr, "Unable to watch the directory '%s': %s\n", path.c_str(), strerror(errno));
+			else {
+				std::lock_guard<std::mutex> lock(dirs_mutex_);
+				watches_[wd] = path;
+			}
+		}
+		DIR* dir = opendir(path.c_str());
+		if (!dir) {
+			fprintf(stderr, "The directory '%s' could not be read, skip it: %s\n", path.c_str(), strerror(errno));
+			return;
+		}
+		struct stat st;
+		fstat(dirfd(dir), &st);
+		const dev_t device = st.st_dev;
+		while (struct dirent* ent = readdir(dir)) {
+			if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
+				continue;  // skip . and .. dirs
+			const bool is_root_file = has_extension(ent->d_name);
+			if (ent->d_type == DT_REG && (inotify_fd_ < 0 || !is_root_file)) {
+				// the inode of the entry is known without a stat() call, only files on other devices would need it
+				if (is_root_file && first_visit(device, ent->d_ino))
+					add(join_path_str(path, ent->d_name));
+				continue;
+			} else if (ent->d_type != DT_REG && ent->d_type != DT_DIR && ent->d_type != DT_LNK && ent->d_type != DT_UNKNOWN)
+				continue;
+			// directories, symlinks, file systems without type information and files while watching
+			const std::string entry = join_path_str(path, ent->d_name);
+			if (stat(entry.c_str(), &st))
+				continue;
+			if (S_ISDIR(st.st_mode)) {
+				if (subdirs && first_visit(st.st_dev, st.st_ino))
+					subdirs->push_back(entry);
+				else if (!subdirs && first_visit(st.st_dev, st.st_ino)) {
+					std::lock_guard<std::mutex> lock(dirs_mutex_);
+					dirs_.push_back(entry);
+					pending_dirs_++;
+					dirs_cond_.notify_one();
+				}
+			} else if (S_ISREG(st.st_mode) && is_root_file)
+				add_scanned(entry, st);
+		}
+		closedir(dir);
+	}
+
+	// take files which are closed after writing or moved into a watched directory, new directories are watched
+	// and scanned as well, including their subdirectories since the walkers are done already
+	void watch_events()
+	{
+		char buffer[64*1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+		struct pollfd pfd = {inotify_fd_, POLLIN, 0};
+		while (!stop_requested && !stopped_) {
+			if (poll(&pfd, 1, 1000) > 0) {
+				const ssize_t length = ::read(inotify_fd_, buffer, sizeof(buffer));
+				for (char* ptr = buffer; length > 0 && ptr < buffer + length; ) {
+					const struct inotify_event* event = reinterpret_cast<const struct inotify_event*>(ptr);
+					ptr += sizeof(struct inotify_event) + event->len;
+					if (!event->len)
+						continue;
+					std::string entry;
+					{
+						std::lock_guard<std::mutex> lock(dirs_mutex_);
+						auto it = watches_.find(event->wd);
+						if (it == watches_.end())
+							continue;
+						entry = join_path_str(it->second, event->name);
+						if (!(event->mask & IN_ISDIR))
+							unsettled_.erase(entry);
+					}
+					struct stat st;
+					if (stat(entry.c_str(), &st))
+						continue;
+					if (S_ISDIR(st.st_mode) && (event->mask & (IN_CREATE | IN_MOVED_TO))) {
+						std::deque<std::string> subdirs;
+						if (first_visit(st.st_dev, st.st_ino))
+							subdirs.push_back(entry);
+						while (!subdirs.empty()) {
+							const std::string dir = subdirs.front();
+							subdirs.pop_front();
+							scan(dir, &subdirs);
+						}
+					} else if (S_ISREG(st.st_mode) && (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO))
+							&& has_extension(event->name) && first_visit(st.st_dev, st.st_ino))
+						add(entry);
+				}
+			}
+
+			// take the deferred files which weren't modified for a while
+			std::vector<std::string> settled;
+			{
+				std::lock_guard<std::mutex> lock(dirs_mutex_);
+				for (auto it = unsettled_.begin(); it != unsettled_.end(); ) {
+					struct stat st;
+					if (stat(it->c_str(), &st))
+						it = unsettled_.erase(it);
+					else if (time(NULL) - st.st_mtime >= watch_settle_seconds) {
+						settled.push_back(*it);
+						it = unsettled_.erase(it);
+					} else
+						++it;
+				}
+			}
+			for (auto& entry : settled) {
+				struct stat st;
+				if (!stat(entry.c_str(), &st) && first_visit(st.st_dev, st.st_ino))
+					add(entry);
+			}
+		}
+		finish();
+	}
+
+	void read(const std::string& list)
+	{
+		std::ifstream file;
+		if (list != "-")
+			file.open(list.c_str());
+		std::istream& in = list == "-" ? std::cin : file;
+		std::string line;
+		// paths to find the given root files in case of relative paths
+		char cwd[PATH_MAX];
+		getcwd(cwd, PATH_MAX-1);
+		std::string program_path = get_selfpath();
+		while (std::getline(in, line)) {
+			line = trim(line);
+			// skip empty lines or lines which start with a hash
+			if (line.empty() || line.find("#") == 0)
+				continue;
+			// the group is the last column if requested
+			std::string group;
+			if (groups_) {
+				const size_t space = line.find_last_of(" \t");
+				if (space == std::string::npos)
+					printf("WARNING: No group given for '%s'\n", line.c_str());
+				else {
+					group = line.substr(space + 1);
+					line = trim(line.substr(0, space));
+				}
+			}
+			// the weight is the last column, if there is none the whole line is the path
+			double weight = 1;
+			bool weighted = false;
+			const size_t space = line.find_last_of(" \t");
+			if (space != std::string::npos && parse_weight(line.substr(space + 1), weight)) {
+				line = trim(line.substr(0, space));
+				weighted = true;
+			}
+			// check if the string contains the desired extension, skip if not
+			if (!strstr(line.c_str(), extension_.c_str()))
+				continue;
+			// try to find the files
+			std::string path;
+			if (check_file(line.c_str()))
+				path = line;
+			else if (check_file(join_path_str(cwd, line).c_str()))
+				path = join_path_str(cwd, line);
+			else if (!program_path.empty() && check_file(join_path_str(program_path, line).c_str()))
+				path = join_path_str(program_path, line);
+			else {
+				printf("WARNING: Couldn't find file '%s', skip it\n", line.c_str());
+				continue;
+			}
+			if (weighted && weights_)
+				weights_->set(path, weight);
+			if (!group.empty())
+				groups_->set(path, group);
+			if (first_visit(path))
+				add(path);
+			else
+				printf("WARNING: The file '%s' was given already, skip it\n", line.c_str());
+		}
+		finish();
+	}
+
+	// a source is done, if it was the last one nothing will be added anymore and the checks finish the remaining files
+	void finish()
+	{
+		if (--producers_)
+			return;
+		if (quarantine_) {
+			unchecked_.close();
+			return;
+		}
+		finished_ = std::chrono::steady_clock::now();
+		queue_.close();
+	}
+
+	WorkQueue<std::string>& queue_;
+	const std::string extension_;
+	const Settings& settings_;
+	FileWeights* weights_;
+	FileGroups* groups_;
+	std::vector<std::thread> threads_;
+	std::vector<std::string> files_;
+	std::set<std::string> skip_;
+	std::map<std::string, std::chrono::steady_clock::time_point> found_;  // only while watching
+	std::chrono::steady_clock::time_point finished_;
+	std::mutex files_mutex_;
+	std::atomic<int> producers_;  // sources which are still read, one more until all sources are added
+	// integrity check
+	FILE* quarantine_;
+	WorkQueue<std::string> unchecked_;
+	std::vector<std::string> quarantined_;
+	unsigned int running_checks_;
+	FileLayout reference_;
+	bool have_reference_;
+	// the selection of the histograms which are compared
+	bool check_all_;
+	std::vector<std::string> check_names_;
+	const PathPatterns* check_patterns_;
+	const PathPatterns* check_exclusions_;
+	// until the reference is known: the good files and the failed ones by their position in the order
+	// they were found, and the number of leading files which failed
+	std::map<size_t, std::pair<std::string, FileLayout>> candidates_;
+	std::set<size_t> failed_;
+	size_t checked_;
+	std::mutex reference_mutex_;
+	// directories which still have to be scanned, including the ones in progress
+	std::deque<std::string> dirs_;
+	size_t pending_dirs_;
+	std::set<std::pair<dev_t, ino_t>> seen_;
+	std::mutex dirs_mutex_;
+	std::condition_variable dirs_cond_;
+	// watching for new files
+	int inotify_fd_;
+	std::map<int, std::string> watches_;
+	std::set<std::string> unsettled_;  // recently modified files found by a scan
+	std::atomic<bool> stopped_;
+};
+
+// thread-safe FIFO queue with a limited capacity, push blocks while the queue is full
+template <typename T>
+class BoundedQueue {
+public:
+	explicit BoundedQueue(size_t capacity) : capacity_(capacity), closed_(false) {}
+
+	void push(T&& item)
+	{
+		std::unique_lock<std::mutex> lock(mutex_);
+		cond_.wait(lock, [this]{ return items_.size() < capacity_; });
+		items_.push_back(std::move(item));
+		cond_.notify_all();
+	}
+
+	// signal that no more items will be pushed
+	void close()
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		closed_ = true;
+		cond_.notify_all();
+	}
+
+	// wait for the next item, returns false if the queue is closed and drained
+	bool pop(T& item)
+	{
+		std::unique_lock<std::mutex> lock(mutex_);
+		cond_.wait(lock, [this]{ return closed_ || !items_.empty(); });
+		if (items_.empty())
+			return false;
+		item = std::move(items_.front());
+		items_.pop_front();
+		cond_.notify_all();
+		return true;
+	}
+
+private:
+	std::deque<T> items_;
+	std::mutex mutex_;
+	std::condition_variable cond_;
+	const size_t capacity_;
+	bool closed_;
+};
+
+// add the bin arrays of identically binned histograms, written as a plain loop over
+// non-aliasing arrays in order to get vectorized by the compiler
+template <typename T>
+void add_arrays(T* __restrict__ dst, const T* __restrict__ src, const Int_t n)
+{
+	for (Int_t i = 0; i < n; i++)
+		dst[i] += src[i];
+}
+
+// dst += factor*src, e. g. for the bin contents or the squared weights of a weighted sum
+template <typename T, typename S>
+void add_scaled_arrays(T* __restrict__ dst, const S* __restrict__ src, const Double_t factor, const Int_t n)
+{
+	for (Int_t i = 0; i < n; i++)
+		dst[i] += factor*src[i];
+}
+
+// fold a value into a FNV-1a hash
+template <typename T>
+void hash_value(ULong64_t& hash, const T& value)
+{
+	const unsigned char* bytes = reinterpret_cast<const unsigned char*>(&value);
+	for (size_t i = 0; i < sizeof(T); i++) {
+		hash ^= bytes[i];
+		hash *= 1099511628211ULL;
+	}
+}
+
+// hash of the binning of a histogram, 0 if its bin arrays can't be added directly
+// (profiles, alphanumeric labels, unknown storage types or average histograms)
+ULong64_t binning_fingerprint(const TH1* hist)
+{
+	if (hist->InheritsFrom(TProfile::Class()) || hist->InheritsFrom(TProfile2D::Class())
+			|| hist->InheritsFrom(TProfile3D::Class()) || hist->TestBit(TH1::kIsAverage))
+		return 0;
+	if (!dynamic_cast<const TArrayD*>(hist) && !dynamic_cast<const TArrayF*>(hist))
+		return 0;
+
+	ULong64_t hash = 14695981039346656037ULL;
+	hash_value(hash, hist->IsA());
+	hash_value(hash, hist->GetNcells());
+	const TAxis* axes[] = {hist->GetXaxis(), hist->GetYaxis(), hist->GetZaxis()};
+	for (int i = 0; i < hist->GetDimension(); i++) {
+		if (axes[i]->GetLabels())
+			return 0;
+		hash_value(hash, axes[i]->GetNbins());
+		hash_value(hash, axes[i]->GetXmin());
+		hash_value(hash, axes[i]->GetXmax());
+		const TArrayD* edges = axes[i]->GetXbins();
+		for (Int_t j = 0; j < edges->fN; j++)
+			hash_value(hash, edges->fArray[j]);
+	}
+
+	return hash ? hash : 1;
+}
+
+// merged histogram, identically binned histograms are added directly on the bin arrays,
+// the binning of the merged histogram is therefore fingerprinted once when it is set;
+// histograms whose fraction of non-empty bins is below the sparse ratio are summed up in a sparse form
+class Accumulator {
+public:
+	Accumulator() : hist_(NULL), fingerprint_(0), sparse_ratio_(0), sparse_(false), sumw2_(false), entries_(0) {}
+	~Accumulator() { delete hist_; }
+
+	Accumulator(Accumulator&& other) : hist_(NULL), fingerprint_(0), sparse_ratio_(0), sparse_(false), sumw2_(false), entries_(0)
+	{
+		swap(other);
+	}
+
+	Accumulator& operator=(Accumulator&& other)
+	{
+		swap(other);
+		return *this;
+	}
+
+	// take ownership of the histogram, it has to be detached from its directory; it's scaled by the weight;
+	// a sparse ratio of 0 keeps it dense
+	void reset(TH1* hist, const double sparse_ratio, const Double_t weight = 1)
+	{
+		if (hist && weight != 1) {  // Scale() keeps the entries, the other files add weight*entries
+			const Double_t entries = hist->GetEntries();
+			if (!hist->GetSumw2N())
+				hist->Sumw2();
+			hist->Scale(weight);
+			hist->SetEntries(weight*entries);
+		}
+		delete hist_;
+		hist_ = hist;
+		fingerprint_ = hist ? binning_fingerprint(hist) : 0;
+		sparse_ratio_ = sparse_ratio;
+		sparse_ = false;
+		bins_.clear();
+		compact();
+	}
+
+	// add weight*h, the squared weights are summed up as weight^2*sumw2 of h, or weight^2*h without them,
+	// like TH1::Add(h, weight) but with a single pass over the bins; h isn't changed
+	void add(TH1* h, const Double_t weight = 1)
+	{
+		if (weight != 1 && !sparse_ && !hist_->GetSumw2N())  // the squared weights differ from the contents now
+			hist_->Sumw2();
+		if (sparse_) {
+			if (add_sparse(h, weight))
+				return;
+			densify();
+			if (weight != 1 && !hist_->GetSumw2N())
+				hist_->Sumw2();
+		}
+		if (add_bins(h, weight))
+			return;
+		if (!fingerprint_ || binning_fingerprint(h) == fingerprint_)
+			hist_->Add(h, weight);
+		else {  // different binning or labels, let ROOT figure out how to combine them
+			std::unique_ptr<TH1> scaled;  // h might be added to further sums
+			if (weight != 1) {
+				scaled.reset(static_cast<TH1*>(h->Clone()));
+				scaled->SetDirectory(0);
+				if (!scaled->GetSumw2N())
+					scaled->Sumw2();
+				scaled->Scale(weight);
+				scaled->SetEntries(weight*h->GetEntries());
+			}
+			TList list;
+			list.Add(scaled ? scaled.get() : h);
+			hist_->Merge(&list);
+			fingerprint_ = binning_fingerprint(hist_);
+		}
+	}
+
+	// add the histogram of another accumulator, the other one will be emptied
+	void add(Accumulator& other)
+	{
+		if (!other.hist_)
+			return;
+		if (!hist_)
+			swap(other);
+		else if (sparse_ && other.sparse_ && compatible(other.hist_, other.sumw2_)) {
+			for (auto& bin : other.bins_) {
+				SparseBin& sum = bins_[bin.first];
+				sum.content += bin.second.content;
+				sum.sumw2 += bin.second.sumw2;
+			}
+			add_stats(other.stats_, other.entries_);
+			other.reset(NULL, 0);
+			if (bins_.size() >= sparse_ratio_*hist_->GetNcells())
+				densify();
+		} else {
+			other.densify();
+			add(other.hist_);
+			other.reset(NULL, 0);
+		}
+	}
+
+	// make this a copy of another accumulator in the same form, the other one isn't changed,
+	// hence adding to either of them gives the same bits
+	void copy(const Accumulator& other)
+	{
+		reset(NULL, 0);
+		if (!other.hist_)
+			return;
+		hist_ = static_cast<TH1*>(other.hist_->Clone());
+		hist_->SetDirectory(0);
+		fingerprint_ = other.fingerprint_;
+		sparse_ratio_ = other.sparse_ratio_;
+		sparse_ = other.sparse_;
+		sumw2_ = other.sumw2_;
+		bins_ = other.bins_;
+		std::copy(other.stats_, other.stats_ + TH1::kNstat, stats_);
+		entries_ = other.entries_;
+	}
+
+	// the sparse form is converted back into the histogram first
+	TH1* get() const
+	{
+		densify();
+		return hist_;
+	}
+
+	explicit operator bool() const { return hist_ != NULL; }
+
+	// hand the histogram over to the caller, the accumulator is empty afterwards
+	TH1* release()
+	{
+		densify();
+		TH1* hist = hist_;
+		hist_ = NULL;
+		fingerprint_ = 0;
+		return hist;
+	}
+
+	// switch to the sparse form if the histogram is empty enough, e. g. again after it was written
+	void compact() const
+	{
+		if (sparse_ratio_ <= 0 || sparse_ || !fingerprint_ || hist_->GetBuffer())
+			return;
+		const Int_t n = hist_->GetNcells();
+		const Double_t* sumw2 = hist_->GetSumw2N() ? hist_->GetSumw2()->GetArray() : NULL;
+		Int_t filled = 0;
+		for (Int_t i = 0; i < n; i++)
+			if (content(i) || (sumw2 && sumw2[i]))
+				filled++;
+		if (filled >= sparse_ratio_*n)
+			return;
+		bins_.reserve(filled);
+		for (Int_t i = 0; i < n; i++)
+			if (content(i) || (sumw2 && sumw2[i])) {
+				SparseBin bin = {content(i), sumw2 ? sumw2[i] : 0};
+				bins_[i] = bin;
+			}
+		hist_->GetStats(stats_);
+		entries_ = hist_->GetEntries();
+		sumw2_ = sumw2 != NULL;
+		// release the bin arrays, the number of cells is kept by the histogram
+		dynamic_cast<TArray*>(hist_)->Set(0);
+		if (sumw2_)
+			hist_->GetSumw2()->Set(0);
+		sparse_ = true;
+	}
+
+	bool sparse() const { return sparse_; }
+
+	// memory needed by the bin arrays of the histogram and by the sparse form
+	size_t dense_bytes() const
+	{
+		if (!fingerprint_)
+			return 0;
+		const size_t bin_size = dynamic_cast<const TArrayD*>(hist_) ? sizeof(Double_t) : sizeof(Float_t);
+		return hist_->GetNcells()*(bin_size + (sumw2_ || hist_->GetSumw2N() ? sizeof(Double_t) : 0));
+	}
+
+	size_t sparse_bytes() const
+	{
+		// every entry is a node with the key, the value and the link to the next node, plus the bucket array
+		return bins_.size()*(sizeof(std::pair<const Int_t, SparseBin>) + sizeof(void*)) + bins_.bucket_count()*sizeof(void*);
+	}
+
+private:
+	Accumulator(const Accumulator&);
+	Accumulator& operator=(const Accumulator&);
+
+	struct SparseBin {
+		Double_t content;
+		Double_t sumw2;
+	};
+
+	void swap(Accumulator& other)
+	{
+		std::swap(hist_, other.hist_);
+		std::swap(fingerprint_, other.fingerprint_);
+		std::swap(sparse_ratio_, other.sparse_ratio_);
+		std::swap(sparse_, other.sparse_);
+		std::swap(sumw2_, other.sumw2_);
+		std::swap(stats_, other.stats_);
+		std::swap(entries_, other.entries_);
+		bins_.swap(other.bins_);
+	}
+
+	Double_t content(const Int_t bin) const
+	{
+		if (const TArrayD* array = dynamic_cast<const TArrayD*>(hist_))
+			return array->GetArray()[bin];
+		return dynamic_cast<const TArrayF*>(hist_)->GetArray()[bin];
+	}
+
+	// check if a histogram can be added bin by bin
+	bool compatible(const TH1* h, const bool sumw2) const
+	{
+		return fingerprint_ && h->IsA() == hist_->IsA() && !h->GetBuffer() && sumw2 == (hist_->GetSumw2N() || sumw2_)
+			&& binning_fingerprint(h) == fingerprint_;
+	}
+
+	// add weight times the statistics, the sum of the squared weights scales with weight^2 like in TH1::Add
+	static void add_weighted_stats(Double_t* sum, const Double_t* stats, const Double_t weight)
+	{
+		for (int i = 0; i < TH1::kNstat; i++)
+			sum[i] += (i == 1 ? weight*weight : weight)*stats[i];
+	}
+
+	void add_stats(const Double_t* stats, const Double_t entries, const Double_t weight = 1)
+	{
+		add_weighted_stats(stats_, stats, weight);
+		entries_ = std::abs(entries_ + weight*entries);
+	}
+
+	// add only the non-empty bins of an identically binned histogram to the sparse form,
+	// it's converted back if it gets too full; returns false if the histogram can't be added this way;
+	// a histogram without squared weights can be added to a sum with them, its contents are used instead
+	bool add_sparse(TH1* h, const Double_t weight = 1)
+	{
+		const bool h_sumw2 = h->GetSumw2N() > 0;
+		if ((weight != 1 && !sumw2_) || !compatible(h, h_sumw2 || sumw2_))
+			return false;
+		Double_t stats[TH1::kNstat] = {0};
+		h->GetStats(stats);
+		add_stats(stats, h->GetEntries(), weight);
+		const Int_t n = h->GetNcells();
+		const Double_t* sumw2 = sumw2_ && h_sumw2 ? h->GetSumw2()->GetArray() : NULL;
+		const TArrayD* array_d = dynamic_cast<const TArrayD*>(h);
+		const Float_t* array_f = array_d ? NULL : dynamic_cast<const TArrayF*>(h)->GetArray();
+		for (Int_t i = 0; i < n; i++) {
+			const Double_t c = array_d ? array_d->GetArray()[i] : array_f[i];
+			const Double_t w = sumw2 ? sumw2[i] : sumw2_ ? c : 0;
+			if (!c && !w)
+				continue;
+			SparseBin& bin = bins_[i];
+			bin.content += weight*c;
+			bin.sumw2 += weight*weight*w;
+		}
+		if (bins_.size() >= sparse_ratio_*n)
+			densify();
+		return true;
+	}
+
+	// convert the sparse form back into the bin arrays of the histogram
+	void densify() const
+	{
+		if (!sparse_)
+			return;
+		const Int_t n = hist_->GetNcells();
+		dynamic_cast<TArray*>(hist_)->Set(n);  // filled with zeros
+		if (sumw2_)
+			hist_->GetSumw2()->Set(n);
+		TArrayD* array_d = dynamic_cast<TArrayD*>(hist_);
+		Float_t* array_f = array_d ? NULL : dynamic_cast<TArrayF*>(hist_)->GetArray();
+		for (auto& bin : bins_) {
+			if (array_d)
+				array_d->GetArray()[bin.first] = bin.second.content;
+			else
+				array_f[bin.first] = bin.second.content;
+			if (sumw2_)
+				hist_->GetSumw2()->GetArray()[bin.first] = bin.second.sumw2;
+		}
+		hist_->PutStats(stats_);
+		hist_->SetEntries(entries_);
+		bins_.clear();
+		std::unordered_map<Int_t, SparseBin>().swap(bins_);  // release the buckets as well
+		sparse_ = false;
+		sumw2_ = false;
+	}
+
+	// add weight times the bin contents, weight^2 times the squared weights and the statistics of an identically
+	// binned histogram, if it has no squared weights its contents are used; returns false if TH1::Add is needed
+	bool add_bins(TH1* h, const Double_t weight = 1)
+	{
+		if (!fingerprint_ || h->IsA() != hist_->IsA() || h->GetBuffer() || (h->GetSumw2N() && !hist_->GetSumw2N())
+				|| weight < 0 || binning_fingerprint(h) != fingerprint_)
+			return false;
+
+		// statistics have to be obtained before the bins change, they might be recomputed from the bin contents
+		Double_t s1[TH1::kNstat] = {0}, s2[TH1::kNstat] = {0};
+		hist_->GetStats(s1);
+		h->GetStats(s2);
+		const Double_t entries = std::abs(hist_->GetEntries() + weight*h->GetEntries());
+
+		const Int_t n = hist_->GetNcells();
+		TArrayD* array_d = dynamic_cast<TArrayD*>(h);
+		const Double_t w2 = weight*weight;
+		if (hist_->GetSumw2N()) {  // before the contents of h are scaled, they might be its squared weights
+			Double_t* dst = hist_->GetSumw2()->GetArray();
+			if (h->GetSumw2N())
+				w2 == 1 ? add_arrays(dst, h->GetSumw2()->GetArray(), n) : add_scaled_arrays(dst, h->GetSumw2()->GetArray(), w2, n);
+			else if (array_d)
+				add_scaled_arrays(dst, array_d->GetArray(), w2, n);
+			else
+				add_scaled_arrays(dst, dynamic_cast<TArrayF*>(h)->GetArray(), w2, n);
+		}
+		if (weight == 1 && array_d)
+			add_arrays(dynamic_cast<TArrayD*>(hist_)->GetArray(), array_d->GetArray(), n);
+		else if (weight == 1)
+			add_arrays(dynamic_cast<TArrayF*>(hist_)->GetArray(), dynamic_cast<TArrayF*>(h)->GetArray(), n);
+		else if (array_d)
+			add_scaled_arrays(dynamic_cast<TArrayD*>(hist_)->GetArray(), array_d->GetArray(), weight, n);
+		else
+			add_scaled_arrays(dynamic_cast<TArrayF*>(hist_)->GetArray(), dynamic_cast<TArrayF*>(h)->GetArray(), weight, n);
+
+		add_weighted_stats(s1, s2, weight);
+		hist_->PutStats(s1);
+		hist_->SetEntries(entries);
+
+		return true;
+	}
+
+	TH1* hist_;
+	ULong64_t fingerprint_;
+	double sparse_ratio_;
+	// sparse form: the non-empty bins and the statistics, the bin arrays of the histogram are released meanwhile
+	mutable bool sparse_;
+	mutable bool sumw2_;
+	mutable std::unordered_map<Int_t, SparseBin> bins_;
+	mutable Double_t stats_[TH1::kNstat];
+	mutable Double_t entries_;
+};
+
+// partial sum of all requested histograms, histograms not found so far are empty
+typedef std::vector<Accumulator> HistogramSet;
+
+// add the histograms of the right set to the left one, the right set will be emptied
+void add_set(HistogramSet& left, HistogramSet& right)
+{
+	if (left.size() < right.size())  // with groups the sets grow with the groups of their files
+		left.resize(right.size());
+	for (size_t i = 0; i < right.size(); i++)
+		left[i].add(right[i]);
+}
+
+// input file which contributed to a merge, size and modification time are used to detect changes,
+// the checksum is only computed if requested
+struct ManifestEntry {
+	std::string path;
+	long long size;
+	long long mtime;
+	std::string checksum;  // empty if not computed
+};
+
+typedef std::vector<ManifestEntry> Manifest;
+
+// name of the object which stores the manifest in ROOT files written by this program
+static const char* manifest_name = "meh_manifest";
+
+// get the current size and modification time of a file, returns false if it doesn't exist
+bool stat_entry(const std::string& path, ManifestEntry& entry)
+{
+	struct stat st;
+	if (stat(path.c_str(), &st))
+		return false;
+	entry.path = canonical_path(path);
+	entry.size = st.st_size;
+	entry.mtime = st.st_mtime;
+	entry.checksum.clear();
+	return true;
+}
+
+// MD5 sum of the whole file, empty if it can't be read
+std::string file_checksum(const std::string& path)
+{
+	TMD5* md5 = TMD5::FileChecksum(path.c_str());
+	if (!md5)
+		return "";
+	std::string checksum = md5->AsString();
+	delete md5;
+	return checksum;
+}
+
+void add_to_manifest(Manifest& manifest, const std::vector<std::string>& paths, const bool checksums = false)
+{
+	ManifestEntry entry;
+	for (auto& path : paths)
+		if (stat_entry(path, entry)) {
+			if (checksums)
+				entry.checksum = file_checksum(path);
+			manifest.push_back(entry);
+		}
+}
+
+// one line per file with size, modification time, checksum ('-' if unknown) and path, separated by tabs
+std::string manifest_to_string(const Manifest& manifest)
+{
+	std::ostringstream out;
+	out << "# meh manifest 2\n";
+	for (auto& entry : manifest)
+		out << entry.size << '\t' << entry.mtime << '\t'
+			<< (entry.checksum.empty() ? "-" : entry.checksum) << '\t' << entry.path << '\n';
+	return out.str();
+}
+
+// version 1 of the format didn't contain the checksum
+bool manifest_from_string(const std::string& str, Manifest& manifest)
+{
+	std::istringstream in(str);
+	std::string line;
+	int version;
+	if (!std::getline(in, line) || sscanf(line.c_str(), "# meh manifest %d", &version) != 1 || version < 1 || version > 2)
+		return false;
+	while (std::getline(in, line)) {
+		std::istringstream fields(line);
+		ManifestEntry entry;
+		if (!(fields >> entry.size >> entry.mtime))
+			return false;
+		if (version > 1 && (!(fields >> entry.checksum) || entry.checksum == "-"))
+			entry.checksum.clear();
+		if (fields.get() != '\t' || !std::getline(fields, entry.path))
+			return false;
+		manifest.push_back(entry);
+	}
+	return true;
+}
+
+// read the manifest stored in a ROOT file written by this program, returns false if there is none
+bool read_manifest(const std::string& path, Manifest& manifest)
+{
+	if (!check_file(path.c_str()))
+		return false;
+	TFile* file = TFile::Open(path.c_str());
+	if (!file || !file->IsOpen()) {
+		delete file;
+		return false;
+	}
+	TObjString* str = dynamic_cast<TObjString*>(file->Get(manifest_name));
+	bool valid = str && manifest_from_string(str->GetString().Data(), manifest);
+	delete str;
+	file->Close();
+	delete file;
+	return valid;
+}
+
+// check if all files of the manifest still exist unchanged, print the first one which doesn't;
+// if only the modification time differs, the file is unchanged if the checksum is still the same
+bool manifest_unchanged(const Manifest& manifest)
+{
+	ManifestEntry current;
+	for (auto& entry : manifest)
+		if (!stat_entry(entry.path, current) || current.size != entry.size || (current.mtime != entry.mtime
+				&& (entry.checksum.empty() || file_checksum(entry.path) != entry.checksum))) {
+			std::cout << "The file " << entry.path << " was changed or removed" << std::endl;
+			return false;
+		}
+	return true;
+}
+
+// combine the manifests of partial merges, returns false if one of them has no manifest
+// or if an input file is contained in more than one of them, since it would be counted twice
+bool combine_manifests(const std::vector<std::string>& partials, Manifest& combined)
+{
+	std::map<std::string, std::string> origin;  // real path of an input file -> partial merge containing it
+	bool valid = true;
+	for (auto& partial : partials) {
+		Manifest manifest;
+		if (!read_manifest(partial, manifest)) {
+			std::cerr << "The file " << partial << " is no partial merge, it contains no manifest" << std::endl;
+			valid = false;
+			continue;
+		}
+		for (auto& entry : manifest) {
+			auto it = origin.insert(std::make_pair(canonical_path(entry.path), partial));
+			if (!it.second) {
+				std::cerr << "The input " << entry.path << " is contained in " << it.first->second
+					<< " and " << partial << std::endl;
+				valid = false;
+			}
+		}
+		combined.insert(combined.end(), manifest.begin(), manifest.end());
+	}
+	return valid;
+}
+
+// open a file for writing with the given compression, -1 for the default of ROOT; NULL if it fails
+TFile* open_output(const std::string& path, Option_t* option, const int compression)
+{
+	TFile* file = compression < 0 ? TFile::Open(path.c_str(), option)
+		: TFile::Open(path.c_str(), option, "", compression);
+	if (file && !file->IsOpen()) {
+		delete file;
+		file = NULL;
+	}
+	return file;
+}
+
+// get the directory of the given path like "dir/subdir/name" below top, missing directories are created;
+// the directories already used are kept in dirs
+TDirectory* make_directory(TDirectory* top, const std::string& path, std::map<std::string, TDirectory*>& dirs)
+{
+	const size_t slash = path.rfind('/');
+	if (slash == std::string::npos)
+		return top;
+	const std::string dir_path = path.substr(0, slash);
+	auto it = dirs.find(dir_path);
+	if (it != dirs.end())
+		return it->second;
+	TDirectory* parent = make_directory(top, dir_path, dirs);
+	const std::string name = dir_path.substr(dir_path.rfind('/') + 1);
+	TDirectory* dir = parent->GetDirectory(name.c_str());  // might exist already if the file is updated
+	if (!dir)
+		dir = parent->mkdir(name.c_str());
+	dirs[dir_path] = dir;
+	return dir;
+}
+
+// write the histograms with the given paths to the current directory, the directory structure is recreated;
+// with several threads the histograms are streamed and compressed into in-memory files in parallel,
+// afterwards their keys are copied one after another into the directories
+void write_set(const std::vector<std::string>& paths, const HistogramSet& set, const unsigned int write_threads)
+{
+	TDirectory* top = gDirectory;
+	std::map<std::string, TDirectory*> dirs;
+	const unsigned int threads = std::min<size_t>(write_threads, set.size());
+	if (threads <= 1) {
+		for (size_t i = 0; i < set.size(); i++)
+			if (set[i]) {
+				make_directory(top, paths[i], dirs)->WriteTObject(set[i].get());
+				set[i].compact();
+			}
+		return;
+	}
+
+	TFile* file = top->GetFile();
+	const int settings = file->GetCompressionSettings();
+	std::vector<std::unique_ptr<TMemFile>> buffers(threads);
+	std::vector<TKey*> keys(set.size(), NULL);
+	std::vector<std::vector<TClass*>> classes(set.size());  // classes of the histograms and their functions
+	std::vector<std::thread> workers;
+	for (unsigned int t = 0; t < threads; t++)
+		workers.push_back(std::thread([t, threads, settings, &set, &buffers, &keys, &classes]{
+			std::ostringstream name;
+			name << "write_buffer_" << t << ".root";
+			buffers[t].reset(new TMemFile(name.str().c_str(), "RECREATE", "", settings));
+			for (size_t i = t; i < set.size(); i += threads) {
+				const TH1* h = set[i].get();
+				if (!h)
+					continue;
+				buffers[t]->WriteTObject(h, h->GetName());
+				keys[i] = buffers[t]->GetKey(h->GetName());
+				classes[i].push_back(h->IsA());
+				TIter next(h->GetListOfFunctions());
+				while (TObject* obj = next())
+					classes[i].push_back(obj->IsA());
+				set[i].compact();
+			}
+		}));
+	for (auto& worker : workers)
+		worker.join();
+
+	// the copied keys don't bring their streamer information along, store it once per class
+	std::set<TClass*> written;
+	for (size_t i = 0; i < set.size(); i++) {
+		if (!keys[i])
+			continue;
+		for (auto cl : classes[i])
+			if (written.insert(cl).second && cl->GetStreamerInfo())
+				cl->GetStreamerInfo()->ForceWriteInfo(file);
+		TKey* key = new TKey(make_directory(top, paths[i], dirs), *keys[i], 0);  // owned by the directory
+		key->WriteFile();
+	}
+	for (auto& buffer : buffers)
+		buffer->Close();
+}
+
+// concatenates the trees of the inputs in the output while the histograms are merged, hence every input is opened
+// only once; the compressed baskets are copied as they are if the branches match (fast cloning), otherwise the
+// entries are copied one by one; the trees are appended in the order the files are merged
+class TreeCopier {
+public:
+	// the trees with the given paths are created in the output when they're found in an input
+	TreeCopier(TFile* output, const std::vector<std::string>& paths, const bool verbose)
+		: output_(output), paths_(paths), trees_(paths.size(), NULL), verbose_(verbose), fast_(0), slow_(0) {}
+
+	// append the trees of an input, can be called by several threads
+	void copy(TDirectory* input, const std::string& name)
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		for (size_t i = 0; i < paths_.size(); i++) {
+			TTree* tree = dynamic_cast<TTree*>(input->Get(paths_[i].c_str()));
+			if (!tree) {
+				std::cerr << "Tree " << paths_[i] << " not found in file " << name << ". Skip it." << std::endl;
+				continue;
+			}
+			TTree*& out = trees_[i];
+			if (!out) {  // an empty tree with the structure of the first one
+				TDirectory* dir = make_directory(output_, paths_[i], dirs_);
+				TDirectory::TContext context(dir);
+				out = tree->CloneTree(0);
+				out->SetDirectory(dir);
+				// the input is closed after copying, the clone mustn't refer to it
+				out->ResetBranchAddresses();
+				tree->RemoveClone(out);
+			}
+			TTreeCloner cloner(tree, out, "fast", TTreeCloner::kNoWarnings);
+			if (cloner.IsValid()) {
+				out->FlushBaskets();  // entries copied one by one before
+				out->SetEntries(out->GetEntries() + tree->GetEntries());
+				cloner.Exec();
+				fast_++;
+			} else {
+				if (verbose_)
+					std::cout << "The branches of tree " << paths_[i] << " in file " << name
+						<< " differ, its entries are copied one by one" << std::endl;
+				tree->CopyAddresses(out);
+				for (Long64_t entry = 0; entry < tree->GetEntries(); entry++) {
+					if (tree->GetEntry(entry) <= 0)
+						break;
+					out->Fill();
+				}
+				tree->CopyAddresses(out, kTRUE);
+				slow_++;
+			}
+		}
+	}
+
+	// write the headers of the trees, their baskets are already written, and close the output
+	void close()
+	{
+		for (auto tree : trees_)
+			if (tree)
+				tree->Write("", TObject::kOverwrite);
+		output_->Close();
+		delete output_;
+		output_ = NULL;
+		std::cout << fast_ << " trees were copied as they are, " << slow_ << " entry by entry" << std::endl;
+	}
+
+private:
+	TFile* output_;
+	const std::vector<std::string> paths_;
+	std::vector<TTree*> trees_;  // owned by their directories
+	std::map<std::string, TDirectory*> dirs_;
+	const bool verbose_;
+	size_t fast_;
+	size_t slow_;
+	std::mutex mutex_;
+};
+
+// read the histograms with the given names from a directory, returns false if none is found
+bool read_set(TDirectory* dir, const std::vector<std::string>& names, HistogramSet& set, const double sparse_ratio)
+{
+	bool found = false;
+	set.clear();
+	set.resize(names.size());
+	for (size_t i = 0; i < names.size(); i++) {
+		TH1* h = dynamic_cast<TH1*>(dir->Get(names[i].c_str()));
+		if (!h)
+			continue;
+		h->SetDirectory(0);
+		set[i].reset(h, sparse_ratio);
+		found = true;
+	}
+	return found;
+}
+
+// read the histograms with the given names from a file, returns false if none is found
+bool read_histograms(const std::string& path, const std::vector<std::string>& names, HistogramSet& set,
+                     const double sparse_ratio)
+{
+	TFile* file = TFile::Open(path.c_str());
+	if (!file || !file->IsOpen()) {
+		delete file;
+		return false;
+	}
+	bool found = read_set(file, names, set, sparse_ratio);
+	file->Close();
+	delete file;
+	return found;
+}
+
+// writes the partial sums together with the manifest of the merged files to a side file,
+// either after a number of merged files or after some time
+class Checkpointer {
+public:
+	Checkpointer(const std::string& path, const size_t every_files, const double every_seconds, const Settings& settings)
+		: path_(path), every_files_(every_files), every_seconds_(every_seconds), settings_(settings), files_(0),
+		  last_(std::chrono::steady_clock::now()) {}
+
+	// count the merged files and check if a checkpoint should be written, only one caller gets true
+	bool due(const size_t merged_files)
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		files_ += merged_files;
+		if (!(every_files_ && files_ >= every_files_) && !(every_seconds_ > 0 &&
+				std::chrono::duration<double>(std::chrono::steady_clock::now() - last_).count() >= every_seconds_))
+			return false;
+		files_ = 0;
+		last_ = std::chrono::steady_clock::now();
+		return true;
+	}
+
+	// write to a temporary file first in order to keep the last checkpoint if the program dies meanwhile,
+	// returns false if it couldn't be written
+	bool write(const std::vector<std::string>& paths, const HistogramSet& set, const Manifest& manifest)
+	{
+		const std::string tmp = path_ + ".tmp";
+		TFile* file = open_output(tmp, "RECREATE", settings_.compression);
+		if (!file) {
+			std::cerr << "Unable to write the checkpoint '" << tmp << "'." << std::endl;
+			return false;
+		}
+		write_set(paths, set, settings_.write_threads);
+		TObjString str(manifest_to_string(manifest).c_str());
+		file->WriteTObject(&str, manifest_name);
+		file->Close();
+		delete file;
+		if (rename(tmp.c_str(), path_.c_str())) {
+			std::cerr << "Unable to move the checkpoint to '" << path_ << "': " << strerror(errno) << std::endl;
+			return false;
+		}
+		if (settings_.verbose)
+			std::cout << "Checkpoint with " << manifest.size() << " files written to " << path_ << std::endl;
+		if (written_)
+			written_(manifest);
+		return true;
+	}
+
+	// called with the manifest after a checkpoint was moved into place
+	void on_written(const std::function<void(const Manifest&)>& callback)
+	{
+		written_ = callback;
+	}
+
+	// read the manifest of the last checkpoint, returns false if there is none or it is unusable
+	bool read_manifest(Manifest& manifest) const
+	{
+		return ::read_manifest(path_, manifest);
+	}
+
+	// read the histograms of the last checkpoint
+	bool read(const std::vector<std::string>& names, HistogramSet& set) const
+	{
+		return read_histograms(path_, names, set, settings_.sparse_ratio);
+	}
+
+	void remove() const
+	{
+		unlink(path_.c_str());
+	}
+
+	const std::string& path() const
+	{
+		return path_;
+	}
+
+private:
+	const std::string path_;
+	const size_t every_files_;
+	const double every_seconds_;
+	const Settings settings_;
+	size_t files_;
+	std::chrono::steady_clock::time_point last_;
+	std::mutex mutex_;
+	std::function<void(const Manifest&)> written_;
+};
+
+// pairwise reduction of numbered partial sums: node (level, index) is the sum of the nodes
+// (level-1, 2*index) and (level-1, 2*index+1), siblings are combined as soon as both are available
+class TreeReducer {
+public:
+	TreeReducer() : in_flight_(0) {}
+
+	// start with an already merged set, e. g. from a checkpoint
+	void seed(HistogramSet&& set, const Manifest& manifest)
+	{
+		seed_ = std::move(set);
+		merged_ = manifest;
+	}
+
+	void submit(size_t index, HistogramSet&& set, const std::vector<std::string>& files)
+	{
+		Manifest entries;
+		add_to_manifest(entries, files);
+		unsigned int level = 0;
+		std::unique_lock<std::mutex> lock(mutex_);
+		merged_.insert(merged_.end(), entries.begin(), entries.end());
+		in_flight_++;
+		while (1) {
+			auto sibling = nodes_.find(std::make_pair(level, index ^ 1));
+			if (sibling == nodes_.end()) {
+				nodes_[std::make_pair(level, index)] = std::move(set);
+				in_flight_--;
+				idle_.notify_all();
+				return;
+			}
+			HistogramSet other = std::move(sibling->second);
+			nodes_.erase(sibling);
+			// combine without holding the lock, other threads can reduce different nodes meanwhile
+			lock.unlock();
+			if (index & 1) {
+				add_set(other, set);
+				set = std::move(other);
+			} else
+				add_set(set, other);
+			lock.lock();
+			index >>= 1;
+			level++;
+		}
+	}
+
+	// write everything merged so far as a checkpoint; the copies are combined in the order of the files, the nodes
+	// stay as they are, hence the reduction and its result don't depend on when the checkpoints are written
+	void checkpoint(Checkpointer& checkpointer, const std::vector<std::string>& paths)
+	{
+		std::unique_lock<std::mutex> lock(mutex_);
+		idle_.wait(lock, [this]{ return !in_flight_; });
+		HistogramSet result(seed_.size());
+		for (size_t i = 0; i < seed_.size(); i++)
+			result[i].copy(seed_[i]);
+		for (auto node : ordered_nodes()) {
+			HistogramSet set(node->size());
+			for (size_t i = 0; i < node->size(); i++)
+				set[i].copy((*node)[i]);
+			add_set(result, set);
+		}
+		checkpointer.write(paths, result, merged_);
+	}
+
+	// number of files submitted so far including the ones of the seed
+	size_t merged_files()
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		return merged_.size();
+	}
+
+	// combine the remaining nodes in the order of the files they contain, has to be called after all threads finished
+	HistogramSet finish()
+	{
+		HistogramSet result = std::move(seed_);
+		fold(result);
+		return result;
+	}
+
+private:
+	// the nodes in the order of the files they contain, i. e. by the sequence number of their first chunk
+	std::vector<HistogramSet*> ordered_nodes()
+	{
+		std::vector<std::pair<size_t, HistogramSet*>> order;
+		for (auto& node : nodes_)
+			order.push_back(std::make_pair(node.first.second << node.first.first, &node.second));
+		std::sort(order.begin(), order.end(),
+			[](const std::pair<size_t, HistogramSet*>& a, const std::pair<size_t, HistogramSet*>& b){ return a.first < b.first; });
+		std::vector<HistogramSet*> nodes;
+		for (auto& node : order)
+			nodes.push_back(node.second);
+		return nodes;
+	}
+
+	// add all nodes to the given set in the order of the files they contain
+	void fold(HistogramSet& result)
+	{
+		for (auto node : ordered_nodes())
+			if (result.empty())
+				result = std::move(*node);
+			else
+				add_set(result, *node);
+		nodes_.clear();
+	}
+
+	std::map<std::pair<unsigned int, size_t>, HistogramSet> nodes_;
+	HistogramSet seed_;
+	Manifest merged_;  // files contained in the seed and the nodes
+	size_t in_flight_;  // sets which are currently combined outside of the lock
+	std::mutex mutex_;
+	std::condition_variable idle_;
+};
+
+// maps the names of the objects stored in a file to the directory and name of their keys
+class KeyIndex {
+public:
+	struct Entry {
+		std::string dir;
+		std::string key;
+		Int_t size;  // uncompressed size of the object
+		std::string class_name;
+	};
+
+	// collect the keys of the given directory first, afterwards the ones of its subdirectories,
+	// the objects are indexed by their full path, e. g. "dir/subdir/name"
+	void build(TDirectory* dir, const std::string& prefix = "")
+	{
+		std::list<TKey*> subdirs;
+		TIter next(dir->GetListOfKeys());
+		while (TKey* key = static_cast<TKey*>(next())) {
+			if (is_directory_key(key))
+				subdirs.push_back(key);
+			else {  // several cycles of a key share the name, keep the first one which is the latest
+				Entry entry = {prefix, key->GetName(), key->GetObjlen(), key->GetClassName()};
+				const std::string path = prefix + key->GetName();
+				if (!paths_.insert(std::make_pair(path, entry)).second)
+					continue;
+				// the subdirectories are indexed depth-first, keep the path closest to the top for a name
+				auto it = names_.find(key->GetName());
+				if (it == names_.end())
+					names_.insert(std::make_pair(std::string(key->GetName()), path));
+				else if (std::count(path.begin(), path.end(), '/') < std::count(it->second.begin(), it->second.end(), '/'))
+					it->second = path;
+			}
+		}
+		for (auto key : subdirs) {
+			TDirectory* subdir = dir->GetDirectory(key->GetName());
+			if (subdir)
+				build(subdir, prefix + key->GetName() + '/');
+		}
+	}
+
+	// get the key of the object with the given path from a file with the indexed structure, NULL if not found
+	TKey* find(TDirectory* file, const std::string& path) const
+	{
+		auto it = paths_.find(path);
+		if (it == paths_.end())
+			return NULL;
+		TDirectory* dir = it->second.dir.empty() ? file : file->GetDirectory(it->second.dir.c_str());
+		if (!dir)
+			return NULL;
+		return dir->GetKey(it->second.key.c_str());
+	}
+
+	// get the full path of an object given by its path or only its name, in the latter case the object closest
+	// to the top of the file is taken if the name occurs more than once; empty if not found
+	std::string resolve(const std::string& name) const
+	{
+		if (paths_.count(name))
+			return name;
+		auto it = names_.find(name);
+		return it == names_.end() ? std::string() : it->second;
+	}
+
+	// get the uncompressed size of the object with the given path, -1 if not found
+	Int_t size(const std::string& path) const
+	{
+		auto it = paths_.find(path);
+		return it == paths_.end() ? -1 : it->second.size;
+	}
+
+	// get the class name stored in the key of the object with the given path, empty if not found
+	std::string class_name(const std::string& path) const
+	{
+		auto it = paths_.find(path);
+		return it == paths_.end() ? std::string() : it->second.class_name;
+	}
+
+	bool empty() const
+	{
+		return paths_.empty();
+	}
+
+private:
+	std::map<std::string, Entry> paths_;
+	std::map<std::string, std::string> names_;  // name -> path of the first object with this name
+};
+
+// number of the slowest files and most expensive histograms listed by --stats
+static const size_t stats_top = 10;
+
+// timings of one merged file in nanoseconds
+struct FileStats {
+	std::string path;
+	long long open;
+	long long lookup;  // finding the keys of the histograms
+	long long read;  // reading and deserializing the histograms
+	long long add;
+	long long bytes;
+
+	long long total() const { return open + lookup + read + add; }
+};
+
+// wall and CPU time of the phases of the program, the timings of every file and the time spent adding
+// every histogram, written as JSON or, if the file name ends with .csv, as CSV
+class MergeStats {
+public:
+	MergeStats() : start_(std::chrono::steady_clock::now()), start_cpu_(cpu_seconds()) {}
+
+	// CPU time of the whole process in seconds
+	static double cpu_seconds()
+	{
+		struct timespec ts;
+		clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+		return ts.tv_sec + ts.tv_nsec*1e-9;
+	}
+
+	// start a phase, the previous one ends
+	void begin_phase(const std::string& name)
+	{
+		end_phase();
+		current_.name = name;
+		current_start_ = std::chrono::steady_clock::now();
+		current_.cpu = cpu_seconds();
+	}
+
+	void end_phase()
+	{
+		if (current_.name.empty())
+			return;
+		current_.wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - current_start_).count();
+		current_.cpu = cpu_seconds() - current_.cpu;
+		phases_.push_back(current_);
+		current_.name.clear();
+	}
+
+	// phases which overlap with others, e. g. the scan for files, have no CPU time of their own
+	void add_phase(const std::string& name, const std::chrono::steady_clock::time_point& begin,
+	               const std::chrono::steady_clock::time_point& end)
+	{
+		Phase phase = {name, std::chrono::duration<double>(end - begin).count(), -1};
+		phases_.push_back(phase);
+	}
+
+	const std::chrono::steady_clock::time_point& start() const { return start_; }
+
+	void add_file(const FileStats& file)
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		files_.push_back(file);
+	}
+
+	void add_histogram_costs(const std::vector<std::string>& paths, const std::vector<long long>& nanoseconds)
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		for (size_t i = 0; i < paths.size(); i++)
+			add_costs_[paths[i]] += nanoseconds[i];
+	}
+
+	bool write(const std::string& path)
+	{
+		end_phase();
+		std::ofstream out(path.c_str());
+		if (!out)
+			return false;
+		const double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_).count();
+		const double cpu = cpu_seconds() - start_cpu_;
+		struct rusage self, children;
+		getrusage(RUSAGE_SELF, &self);
+		getrusage(RUSAGE_CHILDREN, &children);  // worker processes
+		const long peak_rss = std::max(self.ru_maxrss, children.ru_maxrss);  // kB
+
+		std::vector<const FileStats*> slowest;
+		for (auto& file : files_)
+			slowest.push_back(&file);
+		std::sort(slowest.begin(), slowest.end(), [](const FileStats* a, const FileStats* b){ return a->total() > b->total(); });
+		slowest.resize(std::min(slowest.size(), stats_top));
+		std::vector<std::pair<std::string, long long>> costly(add_costs_.begin(), add_costs_.end());
+		std::sort(costly.begin(), costly.end(),
+			[](const std::pair<std::string, long long>& a, const std::pair<std::string, long long>& b){ return a.second > b.second; });
+		costly.resize(std::min(costly.size(), stats_top));
+
+		if (path.size() >= 4 && !strcasecmp(path.c_str() + path.size() - 4, ".csv"))
+			write_csv(out, wall, cpu, peak_rss, slowest, costly);
+		else
+			write_json(out, wall, cpu, peak_rss, slowest, costly);
+		return out.good();
+	}
+
+private:
+	struct Phase {
+		std::string name;
+		double wall;
+		double cpu;  // -1 if unknown
+	};
+
+	static std::string quote(const std::string& str)
+	{
+		std::string quoted = "\"";
+		for (char c : str) {
+			if (c == '"' || c == '\\')
+				quoted += '\\';
+			if ((unsigned char)c >= 0x20)
+				quoted += c;
+		}
+		return quoted + '"';
+	}
+
+	void write_json(std::ostream& out, const double wall, const double cpu, const long peak_rss,
+	                const std::vector<const FileStats*>& slowest, const std::vector<std::pair<std::string, long long>>& costly) const
+	{
+		auto file_json = [&out](const FileStats& file){
+			out << "{\"path\": " << quote(file.path) << ", \"open_ms\": " << file.open*1e-6 << ", \"lookup_ms\": " << file.lookup*1e-6
+				<< ", \"read_ms\": " << file.read*1e-6 << ", \"add_ms\": " << file.add*1e-6 << ", \"bytes\": " << file.bytes << "}";
+		};
+		out << "{\n  \"wall_seconds\": " << wall << ",\n  \"cpu_seconds\": " << cpu << ",\n  \"peak_rss_kb\": " << peak_rss
+			<< ",\n  \"phases\": [";
+		for (size_t i = 0; i < phases_.size(); i++) {
+			out << (i ? ",\n" : "\n") << "    {\"name\": " << quote(phases_[i].name) << ", \"wall_seconds\": " << phases_[i].wall;
+			if (phases_[i].cpu >= 0)
+				out << ", \"cpu_seconds\": " << phases_[i].cpu;
+			out << "}";
+		}
+		out << "\n  ],\n  \"slowest_files\": [";
+		for (size_t i = 0; i < slowest.size(); i++) {
+			out << (i ? ",\n    " : "\n    ");
+			file_json(*slowest[i]);
+		}
+		out << "\n  ],\n  \"costly_histograms\": [";
+		for (size_t i = 0; i < costly.size(); i++)
+			out << (i ? ",\n" : "\n") << "    {\"path\": " << quote(costly[i].first) << ", \"add_ms\": " << costly[i].second*1e-6 << "}";
+		out << "\n  ],\n  \"files\": [";
+		for (size_t i = 0; i < files_.size(); i++) {
+			out << (i ? ",\n    " : "\n    ");
+			file_json(files_[i]);
+		}
+		out << "\n  ]\n}" << std::endl;
+	}
+
+	// one record per line, the first column tells its type
+	void write_csv(std::ostream& out, const double wall, const double cpu, const long peak_rss,
+	               const std::vector<const FileStats*>& slowest, const std::vector<std::pair<std::string, long long>>& costly) const
+	{
+		out << "record,name,wall_seconds,cpu_seconds,open_ms,lookup_ms,read_ms,add_ms,bytes\n";
+		out << "total,," << wall << "," << cpu << ",,,,," << peak_rss*1024LL << "\n";
+		for (auto& phase : phases_) {
+			out << "phase," << quote(phase.name) << "," << phase.wall << ",";
+			if (phase.cpu >= 0)
+				out << phase.cpu;
+			out << ",,,,,\n";
+		}
+		auto file_csv = [&out](const char* record, const FileStats& file){
+			out << record << "," << quote(file.path) << ",,," << file.open*1e-6 << "," << file.lookup*1e-6 << ","
+				<< file.read*1e-6 << "," << file.add*1e-6 << "," << file.bytes << "\n";
+		};
+		for (auto file : slowest)
+			file_csv("slowest_file", *file);
+		for (auto& hist : costly)
+			out << "costly_histogram," << quote(hist.first) << ",,,,,," << hist.second*1e-6 << ",\n";
+		for (auto& file : files_)
+			file_csv("file", file);
+	}
+
+	const std::chrono::steady_clock::time_point start_;
+	const double start_cpu_;
+	Phase current_;
+	std::chrono::steady_clock::time_point current_start_;
+	std::vector<Phase> phases_;
+	std::vector<FileStats> files_;
+	std::map<std::string, long long> add_costs_;
+	std::mutex mutex_;
+};
+
+// information shared by all threads while merging
+struct MergeContext {
+	MergeContext() : prefetch(0), raw(false), chunk_size(parallel_chunk_size), checkpointer(NULL), watch_writer(NULL), watch_interval(0), indexed_lookups(0), rebuilt_lookups(0), bytes_read(0), read_calls(0),
+		read_stall(0), merge_stall(0), raw_reads(0), raw_allocations(0), stats(NULL), weights(NULL), trees(NULL),
+		groups(NULL), group_total(false), ungrouped(0) {}
+
+	Settings settings;
+	std::vector<std::string> names;  // histograms merged in the current pass
+	unsigned int prefetch;  // number of files read ahead in the background
+	bool raw;  // stream the histograms into reused objects instead of creating new ones for every file
+	size_t chunk_size;  // files which are summed up by a thread before they're handed over to the reduction
+	Checkpointer* checkpointer;  // NULL if no checkpoints are written
+	// while watching for new files, the output is rewritten by this every watch_interval seconds
+	Checkpointer* watch_writer;
+	double watch_interval;
+	KeyIndex index;  // key structure of the first file
+	// indices of the files with a different structure, kept for further passes
+	std::map<std::string, KeyIndex> file_indices;
+	std::mutex file_indices_mutex;
+	std::atomic<size_t> indexed_lookups;  // histograms found using the index of the first file
+	std::atomic<size_t> rebuilt_lookups;  // histograms which needed an index of their own file
+	std::atomic<long long> bytes_read;
+	std::atomic<long long> read_calls;
+	// nanoseconds the background reading waited for free queue slots and the merging waited for read files
+	std::atomic<long long> read_stall;
+	std::atomic<long long> merge_stall;
+	// histograms streamed into reused objects and objects which had to be created for that
+	std::atomic<long long> raw_reads;
+	std::atomic<long long> raw_allocations;
+	MergeStats* stats;  // NULL if no statistics are collected
+	std::map<std::string, TDirectory*> inputs;  // inputs which are no files by their name, e. g. in memory
+	const FileWeights* weights;  // NULL if all files have the weight 1
+	TreeCopier* trees;  // NULL if no trees are copied
+	// with groups every file is added to the histograms of its group and, if requested, to the total
+	FileGroups* groups;  // NULL without groups
+	bool group_total;
+	std::atomic<size_t> ungrouped;  // files skipped since they belong to no group
+};
+
+// get the top directory of an input, inputs which are no files are taken from the context, files are opened;
+// file is set to the opened file which has to be closed by the caller, NULL if nothing was opened
+TDirectory* open_input(const std::string& path, const MergeContext& context, TFile*& file)
+{
+	file = NULL;
+	auto it = context.inputs.find(path);
+	if (it != context.inputs.end())
+		return it->second;
+	file = TFile::Open(path.c_str());
+	if (file && !file->IsOpen()) {
+		delete file;
+		file = NULL;
+	}
+	return file;
+}
+
+// find the key of the object with the given name, the key index of the first file is tried first,
+// if the file has a different structure an index for this file is built once and used instead
+TKey* find_key(TDirectory* top, const std::string& path, const std::string& name, MergeContext& context)
+{
+	TKey* key = context.index.find(top, name);
+	if (key) {
+		context.indexed_lookups++;
+		return key;
+	}
+	KeyIndex* file_index;
+	{
+		std::lock_guard<std::mutex> lock(context.file_indices_mutex);
+		file_index = &context.file_indices[path];  // std::map doesn't invalidate references on insertion
+	}
+	// only the thread working on this file uses its index
+	if (file_index->empty())
+		file_index->build(top);
+	key = file_index->find(top, name);
+	if (key)
+		context.rebuilt_lookups++;
+	return key;
+}
+
+// keys which are less than this apart are read with one request, the gap is read and discarded
+static const Long64_t coalesce_gap = 64*1024;
+// upper limit for the size of one request, unless a single key is larger
+static const Long64_t max_request_size = 64*1024*1024;
+
+// read the objects of the given keys with as few requests as possible: the keys are sorted by their
+// position in the file, neighbouring ones are read together into one buffer and deserialized from it
+// by read(index of the key, key record), by default with TKey::ReadObjWithBuffer
+std::vector<TObject*> read_keys(TFile* file, const std::vector<TKey*>& keys,
+                                const std::function<TObject*(size_t, char*)>& read = std::function<TObject*(size_t, char*)>())
+{
+	std::vector<size_t> order(keys.size());
+	for (size_t i = 0; i < order.size(); i++)
+		order[i] = i;
+	std::sort(order.begin(), order.end(),
+		[&keys](size_t a, size_t b){ return keys[a]->GetSeekKey() < keys[b]->GetSeekKey(); });
+
+	std::vector<TObject*> objects(keys.size(), NULL);
+	std::vector<char> buffer;
+	size_t first = 0;
+	while (first < order.size()) {
+		// extend the range as long as the next key is close enough
+		const Long64_t start = keys[order[first]]->GetSeekKey();
+		Long64_t end = start + keys[order[first]]->GetNbytes();
+		size_t last = first + 1;
+		for (; last < order.size(); last++) {
+			const TKey* key = keys[order[last]];
+			const Long64_t key_end = std::max(end, key->GetSeekKey() + key->GetNbytes());
+			if (key->GetSeekKey() - end > coalesce_gap || key_end - start > max_request_size)
+				break;
+			end = key_end;
+		}
+
+		buffer.resize(end - start);
+		const bool failed = file->ReadBuffer(buffer.data(), start, end - start);
+		for (size_t i = first; i < last; i++) {
+			TKey* key = keys[order[i]];
+			if (failed)  // let ROOT try it again key by key
+				objects[order[i]] = key->ReadObj();
+			else if (read)
+				objects[order[i]] = read(order[i], buffer.data() + (key->GetSeekKey() - start));
+			else
+				objects[order[i]] = key->ReadObjWithBuffer(buffer.data() + (key->GetSeekKey() - start));
+		}
+		first = last;
+	}
+
+	return objects;
+}
+
+// decompress the object of a key from its record (starting with the key header) into out, the object starts
+// after the length of the key header like in the buffer of TKey, returns false if the data is corrupt
+bool unzip_key(const TKey* key, char* record, std::vector<char>& out)
+{
+	const Int_t keylen = key->GetKeylen();
+	const Int_t objlen = key->GetObjlen();
+	out.resize(keylen + objlen);
+	if (objlen <= key->GetNbytes() - keylen) {  // stored uncompressed
+		memcpy(out.data() + keylen, record + keylen, objlen);
+		return true;
+	}
+	unsigned char* src = reinterpret_cast<unsigned char*>(record + keylen);
+	unsigned char* dst = reinterpret_cast<unsigned char*>(out.data() + keylen);
+	Int_t total = 0;
+	while (total < objlen) {  // the object is compressed in blocks
+		int nin, nbuf, nout = 0;
+		if (R__unzip_header(&nin, src, &nbuf))
+			break;
+		R__unzip(&nin, src, &nbuf, dst, &nout);
+		if (!nout)
+			break;
+		total += nout;
+		src += nin;
+		dst += nout;
+	}
+	return total == objlen;
+}
+
+long long nanoseconds_since(const std::chrono::steady_clock::time_point& start)
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+// histograms read from one file, they are detached from the file which is already closed again
+struct LoadedFile {
+	std::string path;
+	double weight;  // the histograms are scaled by it when they're added
+	size_t group;  // number of the group the histograms are added to, 0 for none
+	bool total;  // the histograms are added to the total
+	std::vector<TH1*> hists;  // in the order of the requested names, NULL if not found
+	FileStats stats;  // timings of opening and reading the file
+	// with raw reading the histograms are streamed into these objects which are reused for the next file,
+	// an object is only reused for a key with the class of the first file and the class version it was read from before
+	std::vector<std::unique_ptr<TH1>> scratch;
+	std::vector<Version_t> scratch_versions;
+	std::vector<char> buffer;  // decompressed key
+};
+
+// stream the histogram of a key from its record into the reusable object of its slot, a new object is only
+// created if the class or its version differ from the previous key, returns NULL if it isn't a histogram
+TH1* read_into_scratch(TFile* file, TKey* key, char* record, LoadedFile& loaded, const size_t slot, MergeContext& context)
+{
+	if (!unzip_key(key, record, loaded.buffer))
+		return NULL;
+	TBufferFile buffer(TBuffer::kRead, loaded.buffer.size(), loaded.buffer.data(), kFALSE);
+	buffer.SetParent(file);
+	buffer.SetPidOffset(key->GetPidOffset());
+	buffer.SetBufferOffset(key->GetKeylen());
+	UInt_t start, count;
+	const Version_t version = buffer.ReadVersion(&start, &count);
+	buffer.SetBufferOffset(key->GetKeylen());
+
+	// only histograms of the class they have in the first file are streamed into the reused objects, others are
+	// read into new objects; a different binning is streamed as well, the sums handle it when they're added
+	const std::string& path = context.names[slot];
+	if (context.index.class_name(path) != key->GetClassName()) {
+		if (context.settings.verbose)
+			std::cout << "Histogram " << path << " in file " << loaded.path << " is a " << key->GetClassName()
+				<< " instead of a " << context.index.class_name(path) << ", it's read into a new object" << std::endl;
+		return NULL;
+	}
+	std::unique_ptr<TH1>& h = loaded.scratch[slot];
+	if (!h || loaded.scratch_versions[slot] != version || strcmp(h->ClassName(), key->GetClassName())) {
+		if (!inherits_from(key->GetClassName(), TH1::Class()))
+			return NULL;
+		h.reset(static_cast<TH1*>(TClass::GetClass(key->GetClassName())->New()));
+		if (!h)
+			return NULL;
+		loaded.scratch_versions[slot] = version;
+		context.raw_allocations++;
+	} else if (h->GetListOfFunctions())  // the list is read into the existing one
+		h->GetListOfFunctions()->Delete();
+	buffer.MapObject(h.get());
+	h->Streamer(buffer);
+	context.raw_reads++;
+	return h.get();
+}
+
+// open a file and read the requested histograms, returns false if the file can't be used
+bool load_file(const std::string& path, MergeContext& context, LoadedFile& loaded)
+{
+	const std::vector<std::string>& names = context.names;
+	loaded.path = path;
+	loaded.weight = context.weights ? context.weights->get(path) : 1;
+	loaded.group = context.groups ? context.groups->get(path) : 0;
+	loaded.total = !context.groups || context.group_total;
+	if (!loaded.group && !loaded.total) {
+		std::cerr << "The file '" << path << "' belongs to no group. It will be skipped." << std::endl;
+		context.ungrouped++;
+		return false;
+	}
+	loaded.hists.assign(names.size(), NULL);
+	if (context.raw && loaded.scratch.size() != names.size()) {
+		loaded.scratch.clear();
+		loaded.scratch.resize(names.size());
+		loaded.scratch_versions.assign(names.size(), 0);
+	}
+	loaded.stats = FileStats();
+	loaded.stats.path = path;
+	auto start = std::chrono::steady_clock::now();
+	TFile* opened;
+	TDirectory* top = open_input(path, context, opened);
+	loaded.stats.open = nanoseconds_since(start);
+	if (!top) {
+		std::cerr << "Unable to open file '" << path << "'. It will be skipped." << std::endl;
+		return false;
+	}
+	auto close_input = [opened]{
+		if (opened) {
+			opened->Close();
+			delete opened;
+		}
+	};
+	if (!top->GetListOfKeys() || !top->GetListOfKeys()->GetSize()) {
+		std::cerr << "The file '" << path << "' seems to be empty. Skip this file." << std::endl;
+		close_input();
+		return false;
+	}
+	// an input which stays open might have been read before; a directory which doesn't belong to a file
+	// has no file to read from, its keys are read one by one and nothing is counted
+	TFile* file = top->GetFile();
+	const Long64_t bytes_before = opened || !file ? 0 : file->GetBytesRead();
+	const Int_t calls_before = opened || !file ? 0 : file->GetReadCalls();
+
+	// find all keys first to read them ordered by their position in the file
+	start = std::chrono::steady_clock::now();
+	std::vector<TKey*> keys;
+	std::vector<size_t> slots;
+	for (size_t i = 0; i < names.size(); i++) {
+		TKey* key = find_key(top, path, names[i], context);
+		if (!key) {
+			std::cerr << "Histogram " << names[i] << " not found in file " << path << ". Skipt it." << std::endl;
+			continue;
+		}
+		keys.push_back(key);
+		slots.push_back(i);
+	}
+	loaded.stats.lookup = nanoseconds_since(start);
+	start = std::chrono::steady_clock::now();
+	std::vector<TObject*> objects;
+	if (!file)
+		for (auto key : keys)
+			objects.push_back(key->ReadObj());
+	else if (context.raw)
+		objects = read_keys(file, keys, [file, &keys, &slots, &loaded, &context](size_t i, char* record) -> TObject* {
+				TH1* h = read_into_scratch(file, keys[i], record, loaded, slots[i], context);
+				return h ? h : keys[i]->ReadObjWithBuffer(record);
+			});
+	else
+		objects = read_keys(file, keys);
+	for (size_t i = 0; i < objects.size(); i++) {
+		TH1* h = dynamic_cast<TH1*>(objects[i]);
+		if (!h) {
+			delete objects[i];
+			std::cerr << "Object " << names[slots[i]] << " in file " << path << " is not a histogram. Skipt it." << std::endl;
+			continue;
+		}
+		h->SetDirectory(0);  // revoke gDirectory object ownership that this histogram won't get deleted when the file or directory is closed
+		loaded.hists[slots[i]] = h;
+	}
+	loaded.stats.read = nanoseconds_since(start);
+	if (context.trees)
+		context.trees->copy(top, path);
+	const Long64_t bytes = file ? file->GetBytesRead() - bytes_before : 0;
+	const Int_t calls = file ? file->GetReadCalls() - calls_before : 0;
+	loaded.stats.bytes = bytes;
+
+	// the counters include the header, key lists and streamer information read when opening the file
+	context.bytes_read += bytes;
+	context.read_calls += calls;
+	if (context.settings.verbose)
+		printf("%s: read %lld bytes with %d read calls\n", path.c_str(), bytes, calls);
+	close_input();
+
+	return true;
+}
+
+// add the histograms of a read file to the given set, the histograms are consumed
+// except for the reusable objects of raw reading which stay with the file and are copied into empty sums;
+// if costs are given, the time needed to add each histogram is added to them and the total is stored in the file stats
+void accumulate(LoadedFile& loaded, HistogramSet& set, const double sparse_ratio, std::vector<long long>* costs = NULL)
+{
+	auto file_start = std::chrono::steady_clock::now();
+	// with groups the set holds a block of histograms for every group after the one of the total,
+	// it grows with the groups found; the last sum takes over the histogram, the others get a copy
+	const size_t n = loaded.hists.size();
+	std::vector<size_t> offsets;
+	if (loaded.group)
+		offsets.push_back(loaded.group*n);
+	if (loaded.total)
+		offsets.push_back(0);
+	if (set.size() < offsets.front() + n)
+		set.resize(offsets.front() + n);
+	for (size_t i = 0; i < n; i++) {
+		TH1* h = loaded.hists[i];
+		if (!h)
+			continue;
+		auto start = std::chrono::steady_clock::now();
+		for (size_t k = 0; k+1 < offsets.size(); k++) {
+			Accumulator& sum = set[offsets[k] + i];
+			if (sum)
+				sum.add(h, loaded.weight);
+			else {
+				TH1* copy = static_cast<TH1*>(h->Clone());
+				copy->SetDirectory(0);
+				sum.reset(copy, sparse_ratio, loaded.weight);
+			}
+		}
+		Accumulator& sum = set[offsets.back() + i];
+		const bool reused = i < loaded.scratch.size() && h == loaded.scratch[i].get();
+		if (!sum && reused) {  // the reused object stays with the thread for its next files
+			TH1* copy = static_cast<TH1*>(h->Clone());
+			copy->SetDirectory(0);
+			sum.reset(copy, sparse_ratio, loaded.weight);
+		} else if (!sum)
+			sum.reset(h, sparse_ratio, loaded.weight);
+		else {
+			sum.add(h, loaded.weight);
+			if (!reused)
+				delete h;
+		}
+		if (costs)
+			(*costs)[i] += nanoseconds_since(start);
+	}
+	loaded.stats.add = nanoseconds_since(file_start);
+	loaded.hists.clear();
+}
+
+// merge the files returned by next() into the set, if requested the next files are read in by
+// a second thread while the current one is merged; the objects of raw reading are kept in pool,
+// hence they're reused by the next call of the thread
+void merge_stream(const std::function<bool(std::string&)>& next, MergeContext& context, HistogramSet& set,
+                  std::vector<LoadedFile>& pool)
+{
+	std::vector<long long> costs(context.stats ? context.names.size() : 0, 0);
+	auto add = [&context, &set, &costs](LoadedFile& loaded){
+		accumulate(loaded, set, context.settings.sparse_ratio, context.stats ? &costs : NULL);
+		if (context.stats)
+			context.stats->add_file(loaded.stats);
+	};
+
+	LoadedFile loaded;
+	std::string path;
+	if (!context.prefetch) {
+		if (!pool.empty()) {
+			loaded = std::move(pool.back());
+			pool.pop_back();
+		}
+		while (next(path))
+			if (load_file(path, context, loaded))
+				add(loaded);
+		pool.push_back(std::move(loaded));
+		if (context.stats)
+			context.stats->add_histogram_costs(context.names, costs);
+		return;
+	}
+
+	BoundedQueue<LoadedFile> queue(context.prefetch);
+	// merged files are handed back to the reader to reuse their objects
+	std::vector<LoadedFile>& recycled = pool;
+	std::mutex recycled_mutex;
+	std::thread reader([&next, &context, &queue, &recycled, &recycled_mutex]{
+		std::string path;
+		while (next(path)) {
+			LoadedFile file;
+			{
+				std::lock_guard<std::mutex> lock(recycled_mutex);
+				if (!recycled.empty()) {
+					file = std::move(recycled.back());
+					recycled.pop_back();
+				}
+			}
+			if (!load_file(path, context, file))
+				continue;
+			auto start = std::chrono::steady_clock::now();
+			queue.push(std::move(file));
+			context.read_stall += nanoseconds_since(start);
+		}
+		queue.close();
+	});
+	while (1) {
+		auto start = std::chrono::steady_clock::now();
+		bool available = queue.pop(loaded);
+		context.merge_stall += nanoseconds_since(start);
+		if (!available)
+			break;
+		add(loaded);
+		if (context.raw) {
+			std::lock_guard<std::mutex> lock(recycled_mutex);
+			recycled.push_back(std::move(loaded));
+		}
+	}
+	reader.join();
+	if (context.stats)
+		context.stats->add_histogram_costs(context.names, costs);
+}
+
+// take chunks of files from the queue, sum them up and hand the partial sums over to the reduction
+void merge_worker(WorkQueue<std::string>& queue,
+                  MergeContext& context,
+                  TreeReducer& reducer)
+{
+	std::vector<std::string> chunk;
+	size_t sequence;
+	std::vector<LoadedFile> pool;  // kept for all chunks of the thread
+	while (queue.pop_chunk(chunk, context.chunk_size, sequence)) {
+		HistogramSet set(context.names.size());
+		size_t i = 0;
+		merge_stream([&chunk, &i](std::string& path){
+				if (i == chunk.size())
+					return false;
+				path = chunk[i++];
+				return true;
+			}, context, set, pool);
+		reducer.submit(sequence, std::move(set), chunk);
+		if (context.checkpointer && context.checkpointer->due(chunk.size()))
+			reducer.checkpoint(*context.checkpointer, context.names);
+	}
+}
+
+// merge the histograms of the current pass from all files in the queue, starting with the given set;
+// a single thread takes the same chunks and reduction as several ones, hence the result is identical for any number
+HistogramSet merge_files(WorkQueue<std::string>& queue, MergeContext& context, const unsigned int jobs,
+                         HistogramSet seed = HistogramSet(), const Manifest& seed_manifest = Manifest())
+{
+	if (seed.empty())
+		seed.resize(context.names.size());
+
+	TreeReducer reducer;
+	reducer.seed(std::move(seed), seed_manifest);
+	std::vector<std::thread> workers;
+	for (unsigned int i = 0; i < jobs; i++)
+		workers.push_back(std::thread(merge_worker, std::ref(queue), std::ref(context), std::ref(reducer)));
+
+	// while watching, the sums are written periodically if new files were merged meanwhile
+	std::thread writer;
+	std::mutex writer_mutex;
+	std::condition_variable writer_cond;
+	bool done = false;
+	size_t written = reducer.merged_files();
+	if (context.watch_writer)
+		writer = std::thread([&]{
+			std::unique_lock<std::mutex> lock(writer_mutex);
+			while (!writer_cond.wait_for(lock, std::chrono::duration<double>(context.watch_interval), [&done]{ return done; })) {
+				lock.unlock();
+				const size_t merged = reducer.merged_files();
+				if (merged != written) {
+					reducer.checkpoint(*context.watch_writer, context.names);
+					written = merged;
+				}
+				lock.lock();
+			}
+		});
+
+	for (auto& worker : workers)
+		worker.join();
+	if (context.watch_writer) {
+		{
+			std::lock_guard<std::mutex> lock(writer_mutex);
+			done = true;
+		}
+		writer_cond.notify_one();
+		writer.join();
+		if (reducer.merged_files() != written)
+			reducer.checkpoint(*context.watch_writer, context.names);
+	}
+
+	return reducer.finish();
+}
+
+// a forked worker saves its partial sums after this many files or seconds,
+// after a crash a new worker continues from there without the file which caused it
+static const size_t shard_checkpoint_files = 16;
+static const double shard_checkpoint_seconds = 30;
+
+// split the files into shards with about the same total size, the files of a shard keep their order
+std::vector<std::vector<std::string>> split_by_size(const std::vector<std::string>& files, const unsigned int shards)
+{
+	std::vector<std::pair<off_t, size_t>> sizes;
+	for (size_t i = 0; i < files.size(); i++) {
+		struct stat st;
+		sizes.push_back(std::make_pair(stat(files[i].c_str(), &st) ? 0 : st.st_size, i));
+	}
+	// assign the largest files first, always to the shard with the smallest total size
+	std::sort(sizes.begin(), sizes.end(),
+		[](const std::pair<off_t, size_t>& a, const std::pair<off_t, size_t>& b){ return a.first > b.first; });
+	std::vector<off_t> totals(shards, 0);
+	std::vector<std::vector<size_t>> indices(shards);
+	for (auto& file : sizes) {
+		const size_t shard = std::min_element(totals.begin(), totals.end()) - totals.begin();
+		totals[shard] += file.first;
+		indices[shard].push_back(file.second);
+	}
+	std::vector<std::vector<std::string>> result(shards);
+	for (unsigned int i = 0; i < shards; i++) {
+		std::sort(indices[i].begin(), indices[i].end());
+		for (auto index : indices[i])
+			result[i].push_back(files[index]);
+	}
+	return result;
+}
+
+// merge the files of a shard, runs in a forked process; the partial sums are saved regularly together with
+// the manifest of the merged files, a worker started again after a crash continues from there;
+// the index of the file which is currently read is stored in current, -1 if none;
+// returns false if the final partial sums couldn't be saved
+bool merge_shard(const std::vector<std::string>& files, MergeContext& context, Checkpointer& part, volatile long long* current)
+{
+	HistogramSet set(context.names.size());
+	Manifest merged;
+	std::set<std::string> done;
+	if (part.read_manifest(merged)) {
+		part.read(context.names, set);
+		for (auto& entry : merged)
+			done.insert(canonical_path(entry.path));
+	}
+	LoadedFile loaded;
+	for (size_t i = 0; i < files.size(); i++) {
+		if (done.count(canonical_path(files[i])))
+			continue;
+		*current = i;
+		if (load_file(files[i], context, loaded))
+			accumulate(loaded, set, context.settings.sparse_ratio);
+		add_to_manifest(merged, std::vector<std::string>(1, files[i]));
+		if (part.due(1))
+			part.write(context.names, set, merged);
+	}
+	*current = -1;
+	return part.write(context.names, set, merged);
+}
+
+// merge the files in the given number of forked processes, e. g. for classes whose streamers aren't thread-safe;
+// the workers save their partial sums in part files next to the output which are summed up in the order of the shards,
+// a file which makes a worker crash is skipped and reported in failed, the other files of the shard are still merged;
+// returns false if a worker can't be started or fails without reading a file, the other workers are stopped then
+bool merge_processes(const std::vector<std::string>& files, MergeContext& context, const unsigned int procs,
+                     const std::string& output, std::vector<std::string>& failed, HistogramSet& result,
+                     HistogramSet seed = HistogramSet())
+{
+	std::vector<std::vector<std::string>> shards = split_by_size(files, procs);
+	// the file each worker is currently reading, shared with the workers
+	volatile long long* current = static_cast<volatile long long*>(mmap(NULL, procs*sizeof(long long),
+		PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0));
+	if (current == MAP_FAILED) {
+		std::cerr << "Unable to allocate shared memory for the workers: " << strerror(errno) << std::endl;
+		return false;
+	}
+	std::vector<std::string> parts;
+	std::map<pid_t, unsigned int> workers;
+	bool ok = true;
+	auto start = [&](const unsigned int shard){
+		current[shard] = -1;
+		std::cout.flush();
+		pid_t pid = fork();
+		if (pid < 0) {
+			std::cerr << "Unable to start a worker process: " << strerror(errno) << std::endl;
+			return false;
+		} else if (!pid) {
+			Checkpointer part(parts[shard], shard_checkpoint_files, shard_checkpoint_seconds, context.settings);
+			const bool saved = merge_shard(shards[shard], context, part, current + shard);
+			std::cout.flush();
+			_exit(saved ? EXIT_SUCCESS : EXIT_FAILURE);  // skip the cleanup of the objects which belong to the parent
+		}
+		workers[pid] = shard;
+		return true;
+	};
+	// the running workers are killed, they're still reaped below
+	auto stop_workers = [&]{
+		ok = false;
+		for (auto& worker : workers)
+			kill(worker.first, SIGKILL);
+	};
+	for (unsigned int i = 0; i < procs; i++) {
+		std::ostringstream part;
+		part << output << ".part" << i;
+		parts.push_back(part.str());
+		unlink(parts.back().c_str());
+	}
+	for (unsigned int i = 0; i < procs; i++)
+		if (!shards[i].empty() && !start(i)) {
+			stop_workers();
+			break;
+		}
+
+	while (!workers.empty()) {
+		int status;
+		pid_t pid = wait(&status);
+		if (pid < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		auto worker = workers.find(pid);
+		if (worker == workers.end())
+			continue;
+		const unsigned int shard = worker->second;
+		workers.erase(worker);
+		if (!ok || (WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS))
+			continue;
+		const long long index = current[shard];
+		if (index < 0) {  // not caused by one of the files, starting again wouldn't help
+			std::cerr << "The worker for shard " << shard << " failed" << std::endl;
+			stop_workers();
+			continue;
+		}
+		std::vector<std::string>& shard_files = shards[shard];
+		std::cerr << "The worker for shard " << shard << " crashed while reading " << shard_files[index]
+			<< ", continue without this file" << std::endl;
+		failed.push_back(shard_files[index]);
+		shard_files.erase(shard_files.begin() + index);
+		if (!start(shard))
+			stop_workers();
+	}
+	munmap(const_cast<long long*>(current), procs*sizeof(long long));
+	if (!ok) {
+		for (auto& part : parts)
+			unlink(part.c_str());
+		return false;
+	}
+
+	result = std::move(seed);
+	if (result.empty())
+		result.resize(context.names.size());
+	// every part contains a manifest, even if its files contain none of the histograms
+	bool complete = true;
+	for (unsigned int i = 0; i < procs; i++) {
+		Manifest manifest;
+		if (shards[i].empty())
+			continue;
+		else if (complete && !read_manifest(parts[i], manifest)) {
+			std::cerr << "The partial sums of shard " << i << " in '" << parts[i] << "' can't be read" << std::endl;
+			complete = false;
+		} else if (complete) {
+			HistogramSet set;
+			if (read_histograms(parts[i], context.names, set, context.settings.sparse_ratio))
+				add_set(result, set);
+		}
+		unlink(parts[i].c_str());
+	}
+	return complete;
+}
+
+// split the histograms into groups whose estimated memory usage doesn't exceed the budget,
+// the size of a histogram is estimated by the uncompressed size of its key in the first file
+std::vector<std::vector<std::string>> split_by_memory(const std::vector<std::string>& names,
+                                                      const KeyIndex& index,
+                                                      const size_t budget)
+{
+	std::vector<std::vector<std::string>> groups;
+	size_t group_size = 0;
+	for (auto& name : names) {
+		Int_t size = index.size(name);
+		if (size < 0) {
+			std::cerr << "Size of histogram " << name << " unknown, it is not stored in the first file" << std::endl;
+			size = 0;
+		} else if ((size_t)size > budget)
+			std::cerr << "Histogram " << name << " alone exceeds the memory limit, it will be merged on its own" << std::endl;
+		if (groups.empty() || (group_size + size > budget && !groups.back().empty())) {
+			groups.push_back(std::vector<std::string>());
+			group_size = 0;
+		}
+		groups.back().push_back(name);
+		group_size += size;
+	}
+
+	return groups;
+}
+
+// uncompressed size of the objects in a directory and its subdirectories
+long long key_bytes(TDirectory* dir)
+{
+	long long bytes = 0;
+	TIter next(dir->GetListOfKeys());
+	while (TKey* key = static_cast<TKey*>(next())) {
+		if (!is_directory_key(key)) {
+			bytes += key->GetObjlen();
+			continue;
+		}
+		TDirectory* subdir = dir->GetDirectory(key->GetName());
+		if (subdir)
+			bytes += key_bytes(subdir);
+	}
+	return bytes;
+}
+
+// write the histograms and, if given, the manifest of the merged files, returns false if the output can't be opened
+bool write_histograms(const char* output, const std::vector<std::string>& paths, const HistogramSet& set,
+                      const Settings& settings, Option_t* option = "RECREATE", const Manifest* manifest = NULL)
+{
+	TFile* file = open_output(output, option, settings.compression);
+	if (!file) {
+		std::cerr << "Unable to open the output file '" << output << "'." << std::endl;
+		return false;
+	}
+	auto start = std::chrono::steady_clock::now();
+	const long long objects_before = key_bytes(file);
+	const long long file_before = file->GetEND();
+	write_set(paths, set, settings.write_threads);
+	if (manifest) {
+		TObjString str(manifest_to_string(*manifest).c_str());
+		file->WriteTObject(&str, manifest_name);
+	}
+	const long long objects = key_bytes(file) - objects_before;
+	const long long written = file->GetEND() - file_before;
+	file->Close();
+	delete file;
+	const double seconds = nanoseconds_since(start)*1e-9;
+	std::cout << "Wrote " << objects/1e6 << " MB of objects compressed to " << written/1e6 << " MB in "
+		<< seconds << " s (" << (seconds > 0 ? objects/1e6/seconds : 0) << " MB/s)" << std::endl;
+	return true;
+}
+
+// the output of a group, the group is appended to the name of the output before its extension,
+// e. g. merged_run1.root; characters which don't belong into a file name are replaced
+std::string group_output(const std::string& output, const std::string& group)
+{
+	std::string name = group;
+	for (auto& c : name)
+		if (!isalnum(static_cast<unsigned char>(c)) && !strchr("-_.+", c))
+			c = '_';
+	const size_t slash = output.rfind('/');
+	const size_t dot = output.rfind('.');
+	if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+		return output + '_' + name;
+	return output.substr(0, dot) + '_' + name + output.substr(dot);
+}
+
+// write every group of the set into an output of its own, and the total into the output itself if requested;
+// the set holds a block of histograms for every group after the one of the total, see accumulate()
+bool write_groups(const std::string& output, const std::vector<std::string>& paths, HistogramSet& set,
+                  const std::vector<std::string>& groups, const bool total, const Settings& settings)
+{
+	// different groups might end up with the same name, e. g. a/b and a_b
+	std::map<std::string, size_t> outputs;
+	for (size_t g = total ? 0 : 1; g < groups.size(); g++) {
+		auto it = outputs.insert(std::make_pair(g ? group_output(output, groups[g]) : output, g));
+		if (!it.second) {
+			std::cerr << "The groups '" << groups[it.first->second] << "' and '" << groups[g]
+				<< "' would both be written to " << it.first->first << ", nothing is written" << std::endl;
+			return false;
+		}
+	}
+	const size_t n = paths.size();
+	for (size_t g = total ? 0 : 1; g < groups.size(); g++) {
+		HistogramSet block(n);
+		for (size_t i = 0; i < n && g*n + i < set.size(); i++)
+			block[i] = std::move(set[g*n + i]);
+		const std::string path = g ? group_output(output, groups[g]) : output;
+		std::cout << "Write " << (g ? "group " + groups[g] : std::string("the total")) << " to " << path << std::endl;
+		if (!write_histograms(path.c_str(), paths, block, settings))
+			return false;
+	}
+	return true;
+}
+
+// print the memory saved by the sparse form for every histogram which is kept in it
+void report_sparse(const std::vector<std::string>& paths, const HistogramSet& set)
+{
+	size_t dense = 0, sparse = 0;
+	for (size_t i = 0; i < set.size(); i++) {
+		if (!set[i].sparse())
+			continue;
+		std::cout << "Sparse histogram " << paths[i] << ": " << set[i].sparse_bytes() << " bytes instead of "
+			<< set[i].dense_bytes() << " bytes, saved " << set[i].dense_bytes() - std::min(set[i].dense_bytes(), set[i].sparse_bytes())
+			<< " bytes" << std::endl;
+		dense += set[i].dense_bytes();
+		sparse += set[i].sparse_bytes();
+	}
+	if (dense)
+		std::cout << "The sparse histograms need " << sparse/1e6 << " MB instead of " << dense/1e6 << " MB" << std::endl;
+}
+
+}  // namespace
+
+HistogramMerger::HistogramMerger(const Options& options) : options_(options), merge_all_(false) {}
+
+HistogramMerger::~HistogramMerger() {}
+
+void HistogramMerger::add_file(const std::string& path)
+{
+	files_.push_back(path);
+}
+
+void HistogramMerger::add_directory(const std::string& path)
+{
+	std::string dir(path);
+	remove_trailing_slash(dir);
+	directories_.push_back(dir.empty() ? path : dir);  // keep "/"
+}
+
+void HistogramMerger::add_list(const std::string& list)
+{
+	lists_.push_back(list);
+}
+
+// in-memory inputs are identified by their name instead of a path
+std::string HistogramMerger::memory_name(const std::string& name) const
+{
+	if (!name.empty())
+		return name;
+	std::ostringstream str;
+	str << "memory:" << inputs_.size();
+	return str.str();
+}
+
+void HistogramMerger::add_input(TDirectory* dir, const std::string& name)
+{
+	inputs_.push_back(std::make_pair(memory_name(name), dir));
+}
+
+void HistogramMerger::add_buffer(const char* data, const size_t size, const std::string& name)
+{
+	const std::string input = memory_name(name);
+	// the constructor copies the data
+	TMemFile* file = new TMemFile(input.c_str(), const_cast<char*>(data), size);
+	buffers_.push_back(std::unique_ptr<TDirectory>(file));
+	inputs_.push_back(std::make_pair(input, file));
+}
+
+void HistogramMerger::set_weight(const std::string& input, const double weight)
+{
+	weights_[input] = weight;
+}
+
+void HistogramMerger::set_group(const std::string& input, const std::string& group)
+{
+	groups_[input] = group;
+}
+
+void HistogramMerger::select(const std::string& name)
+{
+	histograms_.push_back(name);
+}
+
+void HistogramMerger::select_all()
+{
+	merge_all_ = true;
+}
+
+void HistogramMerger::select_matching(const std::string& pattern)
+{
+	patterns_.push_back(pattern);
+}
+
+void HistogramMerger::exclude(const std::string& pattern)
+{
+	exclusions_.push_back(pattern);
+}
+
+bool HistogramMerger::merge(const std::string& output)
+{
+	return run(output, NULL);
+}
+
+bool HistogramMerger::merge(Histograms& histograms)
+{
+	return run(std::string(), &histograms);
+}
+
+void HistogramMerger::stop()
+{
+	stop_requested = 1;
+}
+
+bool HistogramMerger::run(const std::string& output, Histograms* result)
+{
+	// the extension of the files which should be used
+	const char ext[8] = ".root";
+	const Options& o = options_;
+	const bool checkpoints = o.checkpoint_files || o.checkpoint_seconds || o.resume;
+
+	if (files_.empty() && directories_.empty() && lists_.empty() && inputs_.empty()) {
+		fprintf(stderr, "You've specified neither a file nor a directory as input!\n");
+		return false;
+	}
+
+	if (o.max_memory && checkpoints) {
+		fprintf(stderr, "Checkpoints can't be combined with -m/--max-memory!\n");
+		return false;
+	}
+	if (o.incremental && checkpoints) {
+		fprintf(stderr, "Checkpoints can't be combined with --incremental!\n");
+		return false;
+	}
+
+	if (o.partial && o.reduce) {
+		fprintf(stderr, "Use either --partial or --reduce, not both!\n");
+		return false;
+	}
+	if ((o.partial || o.reduce) && (o.incremental || o.watch)) {
+		fprintf(stderr, "--partial and --reduce can't be combined with --incremental or --watch!\n");
+		return false;
+	}
+	if (o.watch && directories_.empty()) {
+		fprintf(stderr, "--watch needs a directory given with -d/--directory!\n");
+		return false;
+	}
+	if (o.watch && (o.max_memory || checkpoints)) {
+		fprintf(stderr, "--watch can't be combined with -m/--max-memory or checkpoints!\n");
+		return false;
+	}
+
+	if (o.procs && (o.jobs > 1 || o.prefetch || o.watch)) {
+		fprintf(stderr, "--procs can't be combined with -j/--jobs, --prefetch or --watch!\n");
+		return false;
+	}
+	if (o.procs && (o.max_memory || checkpoints)) {
+		fprintf(stderr, "--procs can't be combined with -m/--max-memory or checkpoints!\n");
+		return false;
+	}
+
+	// the manifests and the intermediate files need paths
+	if (!inputs_.empty() && (checkpoints || o.incremental || o.partial || o.reduce)) {
+		fprintf(stderr, "Inputs in memory can't be combined with checkpoints, --incremental, --partial or --reduce!\n");
+		return false;
+	}
+	if (o.trees && (checkpoints || o.incremental || o.reduce || o.watch || o.procs)) {
+		fprintf(stderr, "--trees can't be combined with checkpoints, --incremental, --reduce, --watch or --procs!\n");
+		return false;
+	}
+	// the groups are only known after all files are found, they're merged in one pass into outputs without a manifest
+	const bool grouped = o.group_column || !o.group_regex.empty() || !groups_.empty();
+	if (grouped && (o.max_memory || checkpoints || o.incremental || o.partial || o.reduce || o.watch || o.procs || o.trees)) {
+		fprintf(stderr, "Groups can't be combined with -m/--max-memory, checkpoints, --incremental, --partial, "
+			"--reduce, --watch, --procs or --trees!\n");
+		return false;
+	}
+	if (o.group_column && lists_.empty()) {
+		fprintf(stderr, "--group-column needs a list of files given with -i/--input-file!\n");
+		return false;
+	}
+	if (o.group_total && !grouped) {
+		fprintf(stderr, "--group-total needs groups given with --group-column or --group-regex!\n");
+		return false;
+	}
+	if (result && (o.max_memory || checkpoints || o.incremental || o.partial || o.reduce || o.watch || o.procs || o.trees
+	               || grouped)) {
+		fprintf(stderr, "Histograms merged into memory can't be combined with -m/--max-memory, checkpoints, "
+			"--incremental, --partial, --reduce, --watch, --procs, --trees or groups!\n");
+		return false;
+	}
+
+	// the patterns are checked before anything is read
+	PathPatterns patterns, exclusions;
+	for (auto& pattern : patterns_)
+		if (!patterns.add(pattern))
+			return false;
+	for (auto& pattern : exclusions_)
+		if (!exclusions.add(pattern))
+			return false;
+
+	stop_requested = 0;
+
+	// the output is compressed by as many threads as merge the files
+	Settings settings;
+	settings.verbose = o.verbose;
+	settings.sparse_ratio = o.sparse_ratio;
+	settings.compression = o.compression;
+	settings.write_threads = o.jobs;
+
+	if (settings.verbose)
+		std::cout << "verbose flag is set\nAdditional information will be printed" << std::endl;
+
+	// has to be done before any ROOT object is used by more than one thread
+	// the integrity check looks up classes while the files are opened
+	if (o.jobs > 1 || o.prefetch || o.watch || !o.quarantine_file.empty())
+		ROOT::EnableThreadSafety();
+
+	MergeStats stats;
+	stats.begin_phase("discovery");
+
+	// the checkpoint might already contain some of the files
+	Checkpointer checkpointer(output + ".checkpoint", o.checkpoint_files, o.checkpoint_seconds, settings);
+	Manifest resumed;
+	if (o.resume) {
+		if (!checkpointer.read_manifest(resumed))
+			std::cout << "No usable checkpoint " << checkpointer.path() << " found, start from the beginning" << std::endl;
+		else if (!manifest_unchanged(resumed)) {
+			std::cout << "The checkpoint " << checkpointer.path() << " is outdated, start from the beginning" << std::endl;
+			resumed.clear();
+		} else
+			std::cout << "Resume from " << checkpointer.path() << " which contains "
+				<< resumed.size() << " files" << std::endl;
+	}
+
+	// files merged by a previous run into the output, stored in its manifest
+	Manifest previous;
+	if (o.incremental && read_manifest(output, previous)) {
+		if (manifest_unchanged(previous))
+			std::cout << "The output contains " << previous.size() << " files already, only new files will be added" << std::endl;
+		else {
+			std::cout << "The output is outdated, all files will be merged again" << std::endl;
+			previous.clear();
+		}
+	}
+
+	// the weights of the list are added while it's read
+	FileWeights weights;
+	if (!o.weights_file.empty() && !weights.read_csv(o.weights_file))
+		return false;
+	for (auto& weight : weights_)
+		weights.set(weight.first, weight.second);
+
+	// every file is read once and added to the histograms of its group
+	FileGroups groups;
+	if (!o.group_regex.empty() && !groups.set_regex(o.group_regex))
+		return false;
+	for (auto& group : groups_)
+		groups.set(group.first, group.second);
+
+	MergeContext context;
+	context.settings = settings;
+	context.weights = &weights;
+	if (grouped) {
+		context.groups = &groups;
+		context.group_total = o.group_total;
+	}
+	std::vector<std::string> memory;
+	for (auto& input : inputs_) {
+		context.inputs[input.first] = input.second;
+		memory.push_back(input.first);
+	}
+
+	// the files are merged while the directories or the lists are still read
+	WorkQueue<std::string> queue;
+	FileSource source(queue, ext, settings);
+	source.set_weights(&weights);
+	if (o.group_column)
+		source.set_groups(&groups);
+	if (!resumed.empty() || !previous.empty()) {
+		std::set<std::string> merged;
+		for (auto& entry : resumed)
+			merged.insert(entry.path);
+		for (auto& entry : previous)
+			merged.insert(entry.path);
+		source.skip(merged);
+	}
+	if (!o.quarantine_file.empty() && !source.check(o.quarantine_file, merge_all_, histograms_, &patterns, &exclusions)) {
+		source.no_more_sources();
+		return false;
+	}
+	if (!memory.empty())
+		source.add_paths(memory, true);
+	if (!files_.empty())
+		source.add_paths(files_);
+	for (auto& list : lists_)
+		source.read_list(list);
+	if (!directories_.empty() && !source.scan_directories(directories_, o.watch)) {
+		source.no_more_sources();
+		return false;
+	}
+	source.no_more_sources();
+
+	// the first file defines the histograms and the key structure
+	std::string first_file;
+	if (!queue.wait_first(first_file) && !resumed.empty())  // all files are in the checkpoint already
+		first_file = checkpointer.path();
+	else if (first_file.empty() && !previous.empty()) {
+		std::cout << "No new files found, the output is up to date" << std::endl;
+		return true;
+	} else if (first_file.empty()) {
+		fprintf(stderr, "No files found which could be merged!\n");
+		return false;
+	}
+
+	std::vector<std::string> histograms = histograms_;
+	if (merge_all_ && settings.verbose)
+		std::cout << "All histograms from the files will be read in and merged" << std::endl;
+	// the patterns are matched against the paths of the histograms in the first file
+	const bool discover = merge_all_ || !patterns.empty();
+
+	// the inputs of the partial merges are checked before anything is merged
+	Manifest reduced;
+	if (o.reduce) {
+		source.wait();
+		if (!combine_manifests(source.files(), reduced)) {
+			fprintf(stderr, "The partial merges can't be combined!\n");
+			return false;
+		}
+		std::cout << "Reduce " << source.files().size() << " partial merges containing "
+			<< reduced.size() << " files" << std::endl;
+	}
+
+	/* start of the ROOT related code */
+
+	TFile* file;
+	TDirectory* top;
+	HistogramSet merged_histograms;
+	// if all histograms or patterns should be merged, open the first file to get a list of all histograms;
+	// only the keys are read, hence files with classes without a dictionary can be handled as well
+	if (discover) {
+		top = open_input(first_file, context, file);
+		if (!top) {
+			std::cerr << "Unable to open file '" << first_file << "'. Will terminate." << std::endl;
+			return false;
+		}
+		// check if there is more than one directory in the file
+		std::list<TKey*> dirs;
+		get_list_of_directories(dirs, top);
+		if (dirs.empty() && (!top->GetListOfKeys() || !top->GetListOfKeys()->GetSize())) {
+			std::cerr << "The file '" << first_file << "' seems to be empty. Will terminate." << std::endl;
+			if (file)
+				file->Close();
+			delete file;
+			return false;
+		}
+		std::list<std::pair<std::string, TKey*>> hists;
+		if (o.first_directory && merge_all_ && !dirs.empty()) {
+			std::cout << "Only the histograms of the first directory " << dirs.front()->GetName()
+				<< " will be taken into account" << std::endl;
+			TDirectory* dir = top->GetDirectory(dirs.front()->GetName());
+			if (dir)
+				get_list_of_histograms(hists, dir, std::string(dirs.front()->GetName()) + '/');
+		} else
+			get_list_of_histograms(hists, top);
+		// several cycles of a histogram share the path
+		std::set<std::string> paths;
+		size_t matched = 0;
+		for (auto& hist : hists)
+			if (paths.insert(hist.first).second && (merge_all_ || patterns.matches(hist.first))) {
+				histograms.push_back(hist.first);
+				matched++;
+			}
+		if (!merge_all_ && !matched)
+			std::cerr << "No histogram in the first file " << first_file << " matches the patterns" << std::endl;
+		if (settings.verbose) {
+			std::cout << "The following histograms are stored in the file:" << std::endl;
+			for (auto& hist : hists)
+				std::cout << "Class: "
+					<< hist.second->GetClassName()
+					<< ",\tPath: "
+					<< hist.first
+					<< ",\tTitle: "
+					<< hist.second->GetTitle()
+					<< std::endl;
+			putchar('\n');
+		}
+		if (file)
+			file->Close();
+		delete file;
+	}
+
+	// index the key structure of the first file to find the histograms in the other files directly
+	context.prefetch = o.prefetch;
+	context.raw = o.raw;
+	if (!o.stats_file.empty())
+		context.stats = &stats;
+	if (o.checkpoint_files || o.checkpoint_seconds)
+		context.checkpointer = &checkpointer;
+	top = open_input(first_file, context, file);
+	if (top)
+		context.index.build(top);
+	// the trees of the first file are appended to the output while the first pass reads the files
+	std::vector<std::string> trees;
+	if (o.trees && top) {
+		std::list<std::pair<std::string, TKey*>> keys;
+		get_list_of_objects(keys, top, TTree::Class());
+		std::set<std::string> paths;
+		for (auto& key : keys)
+			if (paths.insert(key.first).second)
+				trees.push_back(key.first);
+		if (trees.empty())
+			std::cout << "No trees found in the first file " << first_file << std::endl;
+	}
+	if (file)
+		file->Close();
+	delete file;
+
+	// the histograms are identified by their full path, names without a path are looked up in the first file
+	for (size_t i = 0; i < histograms_.size(); i++) {
+		const std::string path = context.index.resolve(histograms[i]);
+		if (path.empty())
+			std::cerr << "Histogram " << histograms[i] << " not found in the first file " << first_file << std::endl;
+		else
+			histograms[i] = path;
+	}
+	// a histogram might be selected by its name and a pattern, the exclusions apply to all of them
+	std::set<std::string> selected;
+	std::vector<std::string> kept;
+	size_t excluded = 0;
+	for (auto& name : histograms)
+		if (!selected.insert(name).second)
+			continue;
+		else if (exclusions.matches(name))
+			excluded++;
+		else
+			kept.push_back(name);
+	histograms.swap(kept);
+	if (excluded)
+		std::cout << excluded << " histograms were excluded by the patterns" << std::endl;
+	std::cout << "The following " << histograms.size() << " histograms will be considered:" << std::endl;
+	for (auto && str : histograms)
+		printf("   %s\n", str.c_str());
+
+	// while watching, the output is rewritten periodically, the latency is the time from
+	// finding a file, i. e. it was closed after writing, until it is contained in the output
+	Checkpointer watch_writer(output, 0, 0, settings);
+	size_t latency_count = 0;
+	double latency_sum = 0, latency_min = 0, latency_max = 0;
+	if (o.watch) {
+		context.watch_writer = &watch_writer;
+		context.watch_interval = o.watch_seconds;
+		context.chunk_size = 1;  // don't wait for further files before merging one
+		watch_writer.on_written([&](const Manifest& manifest){
+			const auto now = std::chrono::steady_clock::now();
+			size_t count = 0;
+			double sum = 0, min = 0, max = 0;
+			for (auto& entry : manifest) {
+				std::chrono::steady_clock::time_point found;
+				if (!source.take_found_time(entry.path, found))
+					continue;
+				const double latency = std::chrono::duration<double>(now - found).count();
+				if (!count || latency < min)
+					min = latency;
+				if (!count || latency > max)
+					max = latency;
+				sum += latency;
+				count++;
+			}
+			std::cout << "Output written with " << manifest.size() << " files";
+			if (count)
+				std::cout << ", latency of the " << count << " new files: min " << min << " s, mean "
+					<< sum/count << " s, max " << max << " s";
+			std::cout << std::endl;
+			if (count && (!latency_count || min < latency_min))
+				latency_min = min;
+			if (count && (!latency_count || max > latency_max))
+				latency_max = max;
+			latency_sum += sum;
+			latency_count += count;
+		});
+		std::cout << "Watching for new files, the output is written every "
+			<< o.watch_seconds << " s, stop with Ctrl+C" << std::endl;
+	}
+
+	if (o.jobs > 1 && settings.verbose)
+		std::cout << "Merge the files using " << o.jobs << " threads" << std::endl;
+	else if (o.procs && settings.verbose)
+		std::cout << "Merge the files using " << o.procs << " processes" << std::endl;
+
+	// without a memory limit all histograms are merged in one pass
+	std::vector<std::vector<std::string>> passes(1, histograms);
+	if (o.max_memory) {
+		// every thread keeps its own partial sums, the reduction might hold about as many,
+		// additionally every thread keeps the histograms of the files which are read ahead
+		const size_t copies = 2*o.jobs + o.jobs*o.prefetch;
+		passes = split_by_memory(histograms, context.index, o.max_memory/copies);
+		if (passes.size() > 1)
+			std::cout << "The histograms don't fit into the memory limit, they will be merged in "
+				<< passes.size() << " passes" << std::endl;
+	}
+
+	// an incremental merge reads the existing output, hence it's replaced when everything is written
+	const std::string target = o.incremental && !o.watch ? output + ".tmp" : output;
+	std::unique_ptr<TreeCopier> copier;
+	if (!trees.empty()) {
+		std::cout << "The following " << trees.size() << " trees will be concatenated:" << std::endl;
+		for (auto& str : trees)
+			printf("   %s\n", str.c_str());
+		TFile* tree_output = open_output(target, "RECREATE", settings.compression);
+		if (!tree_output) {
+			std::cerr << "Unable to open the output file '" << target << "'." << std::endl;
+			return false;
+		}
+		copier.reset(new TreeCopier(tree_output, trees, settings.verbose));
+		context.trees = copier.get();
+	}
+	Manifest manifest;
+	std::vector<std::string> failed;  // files which crashed a worker process
+	for (size_t i = 0; i < passes.size(); i++) {
+		if (passes.size() > 1 && settings.verbose)
+			std::cout << "Pass " << i+1 << ": merge " << passes[i].size() << " histograms" << std::endl;
+		context.names = passes[i];
+		stats.begin_phase(passes.size() > 1 ? "merge pass " + std::to_string(i+1) : "merge");
+		HistogramSet seed;
+		if (!resumed.empty() && !checkpointer.read(context.names, seed)) {
+			std::cerr << "Unable to read the histograms of the checkpoint " << checkpointer.path() << std::endl;
+			return false;
+		}
+		if (!previous.empty())
+			read_histograms(output, context.names, seed, settings.sparse_ratio);
+		if (o.procs) {  // the shards are balanced, hence all files have to be known first
+			source.wait();
+			if (!merge_processes(source.files(), context, o.procs, output, failed, merged_histograms, std::move(seed)))
+				return false;
+		} else if (!i)
+			merged_histograms = merge_files(queue, context, o.jobs, std::move(seed), resumed.empty() ? previous : resumed);
+		else {  // all files are known after the first pass
+			WorkQueue<std::string> pass_queue;
+			for (auto& it : source.files())
+				pass_queue.push(it);
+			pass_queue.close();
+			merged_histograms = merge_files(pass_queue, context, o.jobs, std::move(seed));
+		}
+		if (copier) {  // all files were read once, the histograms are added to the trees in the output
+			copier->close();
+			copier.reset();
+			context.trees = NULL;
+		}
+		if (settings.sparse_ratio > 0)
+			report_sparse(context.names, merged_histograms);
+		if (result) {  // nothing is written
+			for (size_t j = 0; j < context.names.size(); j++)
+				if (merged_histograms[j])
+					(*result)[context.names[j]].reset(merged_histograms[j].release());
+			break;
+		}
+		// the manifest is stored inside the output in order to replace both at once
+		const bool last = i+1 == passes.size();
+		if (o.watch)  // written while watching already
+			break;
+		const bool with_manifest = o.incremental || o.partial || o.reduce;
+		if (last && o.reduce)
+			manifest = reduced;
+		else if (last && with_manifest) {
+			source.wait();
+			manifest = previous;
+			std::vector<std::string> files = source.files();
+			for (auto& it : failed)  // not contained, an incremental merge tries them again next time
+				files.erase(std::find(files.begin(), files.end(), it));
+			add_to_manifest(manifest, files, o.incremental);
+		}
+		stats.begin_phase(passes.size() > 1 ? "write pass " + std::to_string(i+1) : "write");
+		if (grouped) {
+			if (!write_groups(target, context.names, merged_histograms, groups.names(), o.group_total, settings))
+				return false;
+		} else if (!write_histograms(target.c_str(), context.names, merged_histograms, settings,
+		                             i || !trees.empty() ? "UPDATE" : "RECREATE", last && with_manifest ? &manifest : NULL))
+			return false;
+		merged_histograms.clear();
+	}
+	if (target != output && rename(target.c_str(), output.c_str())) {
+		std::cerr << "Unable to replace the output '" << output << "': " << strerror(errno) << std::endl;
+		return false;
+	}
+
+	source.wait();
+	if (context.checkpointer || o.resume)  // the merge is complete, the checkpoint isn't needed anymore
+		checkpointer.remove();
+	std::cout << source.files().size() - failed.size() - context.ungrouped << " files were merged";
+	if (grouped)
+		std::cout << " into " << groups.names().size() - 1 << " groups";
+	std::cout << std::endl;
+	if (context.ungrouped)
+		std::cout << context.ungrouped << " files were skipped since they belong to no group" << std::endl;
+	if (!source.quarantined().empty())
+		std::cout << source.quarantined().size() << " files failed the integrity check and were skipped, they are listed in "
+			<< o.quarantine_file << std::endl;
+	if (!failed.empty()) {
+		std::cout << failed.size() << " files were skipped since they crashed a worker:" << std::endl;
+		for (auto& it : failed)
+			std::cout << "   " << it << std::endl;
+	}
+	std::cout << context.indexed_lookups << " of " << context.indexed_lookups + context.rebuilt_lookups
+		<< " histograms were found using the key index of the first file" << std::endl;
+	std::cout << "Read " << context.bytes_read << " bytes from the files with "
+		<< context.read_calls << " read calls" << std::endl;
+	if (o.raw && !o.procs)  // the worker processes count for themselves
+		std::cout << context.raw_reads << " histograms were read into reused objects, "
+			<< context.raw_allocations << " objects had to be created" << std::endl;
+	if (latency_count)
+		std::cout << "Latency from finding a file until it was written: min " << latency_min << " s, mean "
+			<< latency_sum/latency_count << " s, max " << latency_max << " s" << std::endl;
+	if (o.prefetch)
+		std::cout << "Reading waited " << context.read_stall*1e-9 << " s for free slots, merging waited "
+			<< context.merge_stall*1e-9 << " s for read files" << std::endl;
+
+	if (!o.stats_file.empty()) {
+		stats.end_phase();
+		stats.add_phase("file scan", stats.start(), source.finished());
+		if (!stats.write(o.stats_file)) {
+			std::cerr << "Unable to write the statistics to '" << o.stats_file << "'" << std::endl;
+			return false;
+		}
+	}
+
+	return true;
+}
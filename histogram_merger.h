@@ -0,0 +1,117 @@
+// merging of histograms from ROOT files, open directories and files in memory; merge_histograms is a command line
+// interface to it, see README.md for the meaning of the options
+
+#ifndef HISTOGRAM_MERGER_H
+#define HISTOGRAM_MERGER_H
+
+#include <stddef.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <utility>
+
+class TDirectory;
+class TH1;
+
+// collects the inputs and the names of the histograms, merge() does the work; merges can run in several
+// threads at once if ROOT::EnableThreadSafety() was called before, stop() applies to all of them
+class HistogramMerger {
+public:
+	// the settings correspond to the command line options of merge_histograms
+	struct Options {
+		Options() : jobs(1), procs(0), max_memory(0), prefetch(0), raw(false), sparse_ratio(0), compression(-1),
+			checkpoint_files(0), checkpoint_seconds(0), resume(false), incremental(false), partial(false),
+			reduce(false), watch(false), watch_seconds(60), first_directory(false), trees(false),
+			group_column(false), group_total(false), verbose(false) {}
+
+		unsigned int jobs;  // threads which merge the files and compress the output
+		unsigned int procs;  // worker processes which merge the files instead of threads, 0 for none
+		size_t max_memory;  // bytes for the merged histograms, 0 for no limit
+		unsigned int prefetch;  // files which are read ahead
+		bool raw;  // stream the histograms into reused objects
+		double sparse_ratio;  // fill ratio below which histograms are kept sparse, 0 to disable
+		int compression;  // ROOT compression settings of the output, e. g. 404 for LZ4:4, -1 for the default
+		size_t checkpoint_files;
+		double checkpoint_seconds;
+		bool resume;
+		bool incremental;
+		bool partial;
+		bool reduce;
+		bool watch;  // keep watching the input directories for new files until stop() is called
+		double watch_seconds;
+		bool first_directory;  // only merge the first directory if all histograms are selected
+		bool trees;  // concatenate the trees of the first input in the output as well
+		// every group is merged into an output of its own, see set_group(); the group of a file is given
+		// by the last column of a list, or by the first capture of a regular expression on the path
+		bool group_column;
+		std::string group_regex;  // empty if not used
+		bool group_total;  // merge all files into the output itself as well
+		std::string stats_file;  // empty if no statistics are written
+		std::string quarantine_file;  // empty if the files aren't checked before they're merged
+		std::string weights_file;  // CSV file with a path and a weight in every line, empty if not used
+		bool verbose;
+	};
+
+	// the merged histograms by their full path, detached from any directory
+	typedef std::map<std::string, std::unique_ptr<TH1>> Histograms;
+
+	explicit HistogramMerger(const Options& options = Options());
+	~HistogramMerger();
+
+	// the inputs can be combined, every file is merged only once
+	void add_file(const std::string& path);
+	// scanned recursively for .root files
+	void add_directory(const std::string& path);
+	// a file with one path per line, "-" reads the list from the standard input
+	void add_list(const std::string& list);
+	// the keys of an open directory, e. g. of a TFile or TMemFile, the paths of the histograms are relative to it;
+	// it isn't owned and has to stay open during the merge, the name identifies it in messages and has to be unique
+	void add_input(TDirectory* dir, const std::string& name = "");
+	// the image of a ROOT file, e. g. the buffer of a TMemFile written by another process, the data is copied
+	void add_buffer(const char* data, const size_t size, const std::string& name = "");
+
+	// the histograms of an input, given by its path or the name of an input in memory, are scaled by the
+	// weight when they're added; the weight of the other inputs is 1, unless it's given in a list or the CSV file
+	void set_weight(const std::string& input, const double weight);
+	// the histograms of an input are merged into the output of the group, e. g. OUTPUT_group.root
+	void set_group(const std::string& input, const std::string& group);
+
+	// a histogram given by its path, e. g. "dir/name", or by its name alone which is looked up in the first input
+	void select(const std::string& name);
+	// all histograms of the first input
+	void select_all();
+	// the histograms of the first input which match a glob pattern, e. g. "TaggerE_*", or a regular expression
+	// with the prefix "re:", e. g. "re:^Tagger"; a pattern with a slash is matched against the full path
+	void select_matching(const std::string& pattern);
+	// skip the histograms which match a pattern, even if they're selected otherwise
+	void exclude(const std::string& pattern);
+
+	// merge the inputs into the output file, returns false if the merge failed
+	bool merge(const std::string& output);
+	// merge the inputs and return the histograms without writing anything, the histograms which are
+	// selected have to fit into the memory at once and the options which need an output can't be used
+	bool merge(Histograms& histograms);
+
+	// stop watching for new files, can be called from a signal handler
+	static void stop();
+
+private:
+	bool run(const std::string& output, Histograms* histograms);
+	std::string memory_name(const std::string& name) const;
+
+	Options options_;
+	std::vector<std::string> files_;
+	std::vector<std::string> directories_;
+	std::vector<std::string> lists_;
+	std::vector<std::pair<std::string, TDirectory*>> inputs_;  // in-memory inputs by their name
+	std::vector<std::unique_ptr<TDirectory>> buffers_;  // files created from the buffers
+	std::map<std::string, double> weights_;
+	std::map<std::string, std::string> groups_;
+	std::vector<std::string> histograms_;
+	std::vector<std::string> patterns_;
+	std::vector<std::string> exclusions_;
+	bool merge_all_;
+};
+
+#endif
@@ -1,35 +1,73 @@
-// compile with: g++ -std=c++11 -O3 merge_histograms.cpp -o merge_histograms `root-config --cflags --glibs` -lSpectrum -lHistPainter
+// compile with: g++ -std=c++11 -O3 merge_histograms.cpp histogram_merger.cpp -o merge_histograms `root-config --cflags --glibs` -lSpectrum -lHistPainter
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <iostream>
-#include <fstream>
 #include <string.h>
+#include <string>
 #include <vector>
-#include <list>
-#include <algorithm>
-#include <exception>
 #include <dirent.h>
+#include <signal.h>
 #include <unistd.h>  // getopt
 #include <getopt.h>  // getopt_long
 #include <errno.h>
-#include <libgen.h>  // basename, dirname
 #include <ctype.h>  // isdigit
 #include <limits.h>
-//#include <sys/types.h>
 
-#include "TClass.h"
-#include "TFile.h"
-#include "TH1.h"
-#include "TCollection.h"
+#include "histogram_merger.h"
 
 /* Flag set by `--verbose'. */
 static int verbose_flag;
+/* Flag set by `--resume'. */
+static int resume_flag;
+/* Flag set by `--incremental'. */
+static int incremental_flag;
+/* Flag set by `--watch'. */
+static int watch_flag;
+/* Flag set by `--first-directory'. */
+static int first_directory_flag;
+/* Flag set by `--raw'. */
+static int raw_flag;
+/* Flag set by `--partial'. */
+static int partial_flag;
+/* Flag set by `--reduce'. */
+static int reduce_flag;
+/* Flag set by `--trees'. */
+static int trees_flag;
+/* Flag set by `--group-column'. */
+static int group_column_flag;
+/* Flag set by `--group-total'. */
+static int group_total_flag;
+
+/* values of the options which only have a long form */
+enum {
+	OPT_PREFETCH = 256,
+	OPT_CHECKPOINT,
+	OPT_CHECKPOINT_INTERVAL,
+	OPT_WATCH_INTERVAL,
+	OPT_PROCS,
+	OPT_COMPRESSION,
+	OPT_SPARSE,
+	OPT_STATS,
+	OPT_QUARANTINE,
+	OPT_WEIGHTS,
+	OPT_GROUP_REGEX
+};
 
 /* specify the expected options */
 static struct option long_options[] = {
 	/* options set a flag */
 	{"verbose", no_argument, &verbose_flag, 1},
+	{"resume", no_argument, &resume_flag, 1},
+	{"incremental", no_argument, &incremental_flag, 1},
+	{"watch", no_argument, &watch_flag, 1},
+	{"first-directory", no_argument, &first_directory_flag, 1},
+	{"raw", no_argument, &raw_flag, 1},
+	{"partial", no_argument, &partial_flag, 1},
+	{"reduce", no_argument, &reduce_flag, 1},
+	{"trees", no_argument, &trees_flag, 1},
+	{"group-column", no_argument, &group_column_flag, 1},
+	{"group-total", no_argument, &group_total_flag, 1},
 	// to also use the short form one has to use {"verbose", no_argument, 0, 'v'} and handle it in the switch
 	/* options don't set a flag, distinguish them by their indices */
 	{"help", no_argument, 0, 'h'},
@@ -37,6 +75,19 @@ static struct option long_options[] = {
 	{"plots", required_argument, 0, 'p'},
 	{"directory", required_argument, 0, 'd'},
 	{"input-file", required_argument, 0, 'i'},
+	{"jobs", required_argument, 0, 'j'},
+	{"max-memory", required_argument, 0, 'm'},
+	{"prefetch", required_argument, 0, OPT_PREFETCH},
+	{"checkpoint", required_argument, 0, OPT_CHECKPOINT},
+	{"checkpoint-interval", required_argument, 0, OPT_CHECKPOINT_INTERVAL},
+	{"watch-interval", required_argument, 0, OPT_WATCH_INTERVAL},
+	{"procs", required_argument, 0, OPT_PROCS},
+	{"compression", required_argument, 0, OPT_COMPRESSION},
+	{"sparse", required_argument, 0, OPT_SPARSE},
+	{"stats", required_argument, 0, OPT_STATS},
+	{"quarantine", required_argument, 0, OPT_QUARANTINE},
+	{"weights", required_argument, 0, OPT_WEIGHTS},
+	{"group-regex", required_argument, 0, OPT_GROUP_REGEX},
 	{0, 0, 0, 0}
 };
 
@@ -47,7 +98,9 @@ void print_help(const char* name)
               << "Options:\n"
               << "\t-h, --help\t\tShow this help message\n"
               << "\t-i, --input-file FILE\tFile containing a list of files which\n"
-              << indent << "should be used\n"
+              << indent << "should be used, '-' reads the list\n"
+              << indent << "from the standard input; a number after\n"
+              << indent << "a path is the weight of the file\n"
               << "\t-d, --directory INPUT-DIR   Specify a directory name to scan\n"
               << indent << "recursively for files\n"
               << "\t-o, --output FILENAME\tFile name where the merged histograms\n"
@@ -56,7 +109,84 @@ void print_help(const char* name)
               << indent << "histogram(s) which should be merged\n"
               << indent << "from each input file\n"
               << indent << "Use the keyword 'all' to merge all\n"
-              << indent << "histograms stored in the given files\n"
+              << indent << "histograms stored in the given files;\n"
+              << indent << "histograms are given by their path in\n"
+              << indent << "the file, e. g. dir/name, a name alone\n"
+              << indent << "is looked up in the first file;\n"
+              << indent << "glob patterns like 'TaggerE_*' and\n"
+              << indent << "regular expressions like 're:^Tagger'\n"
+              << indent << "select the matching histograms, a\n"
+              << indent << "leading '!' excludes them instead\n"
+              << "\t--first-directory\tWith -p all, only merge the histograms\n"
+              << indent << "of the first directory in the file\n"
+              << "\t--trees\t\t\tConcatenate the trees of the first file\n"
+              << indent << "in the output while the histograms are\n"
+              << indent << "merged, baskets are copied as they are\n"
+              << "\t-j, --jobs N\t\tNumber of threads used to merge the\n"
+              << indent << "files (default: 1); the result is\n"
+              << indent << "bit-identical for every N\n"
+              << "\t--procs N\t\tMerge the files in N processes instead of\n"
+              << indent << "threads, for classes which aren't\n"
+              << indent << "thread-safe; a file which crashes a\n"
+              << indent << "process is skipped\n"
+              << "\t-m, --max-memory SIZE\tMemory for the merged histograms, e. g.\n"
+              << indent << "500M or 4G; if they don't fit, they are\n"
+              << indent << "merged in several passes over the files\n"
+              << "\t--prefetch K\t\tRead up to K files in the background\n"
+              << indent << "while the current one is merged\n"
+              << "\t--compression ALGO:LEVEL   Compression of the output, ALGO is\n"
+              << indent << "one of ZLIB, LZMA, LZ4 or ZSTD, LEVEL\n"
+              << indent << "0-9 (default: 5), e. g. LZ4:1 for fast\n"
+              << indent << "intermediate files or LZMA:9 to archive\n"
+              << "\t--sparse RATIO\t\tKeep histograms with less than RATIO\n"
+              << indent << "(e. g. 0.01) of their bins filled in a\n"
+              << indent << "sparse form while merging\n"
+              << "\t--raw\t\t\tStream the histograms of every file into\n"
+              << indent << "reused objects instead of creating new\n"
+              << indent << "ones, as long as class and version match\n"
+              << "\t--checkpoint N\t\tSave the partial sums every N files to\n"
+              << indent << "OUTPUT.checkpoint\n"
+              << "\t--checkpoint-interval SECONDS   Save the partial sums\n"
+              << indent << "every SECONDS seconds\n"
+              << "\t--resume\t\tContinue from the last checkpoint and\n"
+              << indent << "skip the files merged already\n"
+              << "\t--incremental\t\tOnly add new files to an existing output,\n"
+              << indent << "everything is merged again if one of\n"
+              << indent << "the files in the output was changed\n"
+              << "\t--partial\t\tWrite a partial merge which contains the\n"
+              << indent << "manifest of the merged files, partial\n"
+              << indent << "merges are combined with --reduce\n"
+              << "\t--reduce\t\tMerge the partial merges given with -i\n"
+              << indent << "or -d, fails if an input file is\n"
+              << indent << "contained in more than one of them;\n"
+              << indent << "the result is a partial merge again\n"
+              << "\t--watch\t\t\tKeep watching the directory given with\n"
+              << indent << "-d and merge new files as soon as they\n"
+              << indent << "are written until interrupted\n"
+              << "\t--watch-interval SECONDS   Rewrite the output every SECONDS\n"
+              << indent << "seconds while watching (default: 60)\n"
+              << "\t--weights FILE\t\tCSV file with a path and a weight in every\n"
+              << indent << "line, the histograms of a file are\n"
+              << indent << "scaled by its weight, e. g. to normalize\n"
+              << indent << "them by the luminosity\n"
+              << "\t--group-column\t\tThe last column of the list given with -i\n"
+              << indent << "is the group of the file, every group\n"
+              << indent << "is merged into OUTPUT_GROUP.root\n"
+              << "\t--group-regex REGEX\tThe group of a file is the first capture\n"
+              << indent << "of REGEX on its path, e. g.\n"
+              << indent << "'run_([0-9]+)_' or '/(period[^/]+)/'\n"
+              << "\t--group-total\t\tWith groups, also merge all files into\n"
+              << indent << "OUTPUT, in the same pass\n"
+              << "\t--quarantine FILE\tCheck the header, the end and the key\n"
+              << indent << "lists of every file in parallel before\n"
+              << indent << "it's merged, files which are corrupt or\n"
+              << indent << "lack keys of the first file are skipped\n"
+              << indent << "and listed in FILE\n"
+              << "\t--stats FILE\t\tWrite the wall and CPU time of every phase,\n"
+              << indent << "the timings of every file, the peak\n"
+              << indent << "memory, the slowest files and the most\n"
+              << indent << "expensive histograms to FILE as JSON,\n"
+              << indent << "or as CSV if FILE ends with .csv\n"
               << "\t--verbose\t\tPrint additional information"
               << std::endl;
 }
@@ -78,282 +208,62 @@ static unsigned int is_decimal(char* const str)
 	return (is_udec(&str[(str[0] == '-') || (str[0] == '+')]));
 }
 
-// method for a non case sensitive comparison of strings
-bool cmp_nocase(std::string first, std::string second)
-{
-	unsigned int i = 0;
-	while ((i < first.length()) && (i < second.length())) {
-		if (tolower(first[i]) < tolower(second[i])) return true;
-		else if (tolower(first[i]) > tolower(second[i])) return false;
-		++i;
-	}
-	if (first.length() > second.length()) return true;
-	else return false;
-}
-
-void remove_trailing_slash(char* path)
-{
-	std::string pathname(path);
-	while (!pathname.empty() && pathname.back() == '/')
-		pathname.pop_back();
-
-	strcpy(path, pathname.c_str());
-}
-
-void remove_trailing_slash(std::string& path)
-{
-	while (!path.empty() && path.back() == '/')
-		path.pop_back();
-}
-
-void add_trailing_slash(char* path)
-{
-	std::string pathname(path);
-	if (!pathname.empty() && pathname.back() != '/')
-		pathname += '/';
-
-	strcpy(path, pathname.c_str());
-}
-
-void add_trailing_slash(std::string& path)
-{
-	if (!path.empty() && path.back() != '/')
-		path += '/';
-}
-
-const char* join_path(const char* path1, const char* path2, const char* path_sep = "/")
-{
-	char* path = new char[PATH_MAX+1];
-	strcpy(path, path1);
-	strcat(path, path_sep);
-	strcat(path, path2);
-
-	return path;
-}
-
-const char* join_path(const std::string path1, const std::string path2, const std::string path_sep = "/")
-{
-	return (path1 + path_sep + path2).c_str();
-}
-
-const std::string join_path_str(const std::string path1, const std::string path2)
-{
-	std::string path(path1);
-	add_trailing_slash(path);
-	return path + path2;
-}
-
-std::string get_base_name(const std::string& str,
-                          const std::string& path_sep = "/\\")
-{
-	const size_t end = str.find_last_of(path_sep);
-	if (end == std::string::npos)
-		return str;  // no path given, return string
-
-	return str.substr(0, end);
-}
-
-// trim whitespaced at the beginning and the end of a string
-std::string trim(const std::string& str,
-                 const std::string& whitespace = " \t")
-{
-	const auto begin = str.find_first_not_of(whitespace);
-	if (begin == std::string::npos)
-		return "";  // no content
-
-	const auto end = str.find_last_not_of(whitespace);
-	const auto range = end - begin + 1;
-
-	return str.substr(begin, range);
-}
-
-// first trim the string, then reduce whitespaces between substrings to 'fill'
-std::string reduce(const std::string& str,
-                   const std::string& fill = " ",
-                   const std::string& whitespace = " \t")
-{
-	// trim first
-	auto result = trim(str, whitespace);
-
-	// replace sub ranges
-	auto begin_space = result.find_first_of(whitespace);
-	while (begin_space != std::string::npos)
-	{
-		const auto end_space = result.find_first_not_of(whitespace, begin_space);
-		const auto range = end_space - begin_space;
-
-		result.replace(begin_space, range, fill);
-
-		const auto new_start = begin_space + fill.length();
-		begin_space = result.find_first_of(whitespace, new_start);
-	}
-
-	return result;
-}
-
-// recursively get all files from a given directory path
-void list_files(const char* path, std::list<std::string>& file_list)
+// parse a size in bytes with an optional suffix k, M or G, returns false if the string is invalid
+bool parse_size(const char* str, size_t& size)
 {
-	DIR *dir;
-	struct dirent *ent;
-
-	if (dir = opendir(path)) {
-		while (ent = readdir(dir))  // loop over dir as long as ent gets a pointer assigned
-			if (ent->d_type == DT_DIR)  // is directory?
-				if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
-					continue;  // skip . and .. dirs
-				else
-					list_files(join_path(path, ent->d_name), file_list);
-					// in case of strings this can be easily written as list_files(path + '/' + std::string(ent->d_name)), file_list);
-			else
-				file_list.push_back(join_path(path, ent->d_name));
-
-		closedir(dir);
-	} else {
-		fprintf(stderr, "The directory '%s' could not be read!\n", path);
-		exit(EXIT_FAILURE);
+	char* end;
+	errno = 0;
+	unsigned long long value = strtoull(str, &end, 10);
+	if (errno || end == str || str[0] == '-')
+		return false;
+	// every unit multiplies by 1024 once more
+	static const char* units = "KMG";
+	const char* unit = *end ? strchr(units, toupper(*end)) : NULL;
+	if (unit) {
+		value <<= 10*(unit - units + 1);
+		end++;
 	}
-
-	return;
-}
-
-// remove all entries from the list which don't contain the given pattern
-void filter_list(std::list<std::string>& list, const char* pattern)
-{
-	std::list<std::string>::iterator it = list.begin();
-	while (it != list.end())
-		if (!strstr((*it).c_str(), pattern))
-			it = list.erase(it);
-		else
-			it++;
-}
-
-// get the real path of the given char array if it contains any special chars
-const char* get_real_path(const char* path)
-{
-	DIR *dir;
-
-	// check if the directory could be opened
-	dir = opendir(path);
-	if (dir) {
-		closedir(dir);
-		return path;
-	}
-
-	char* _path = (char*)malloc(PATH_MAX+1);  // allocate memory for new path
-	// if not, try to resolve the path if it contains a tilde
-	if (*path == '~') {
-		// build the new path by replacing the home directory
-		strcpy(_path, getenv("HOME"));
-		strcat(_path, path+1);
-
-		// check if the directory could be opened
-		dir = opendir(_path);
-		if (dir) {  // check if we can open this new path
-			closedir(dir);
-			return _path;
-		} else {  // if not, let's assume it might be a file and get the dirname of it
-			const char* new_path = dirname(_path);
-			return new_path;
-		}
-	}
-
-	// if the above doesn't work, let's give realpath() a try to do it
-	// it should resolve the path (~, symlinks, ...), but often doesn't work as expected...
-	realpath(path, _path);
-	// get the dirname in case a file is appended or a tilde in some strange cases
-	const char* new_path = dirname(_path);
-
-	// check if the directory could be opened
-	dir = opendir(new_path);
-	if (dir) {
-		closedir(dir);
-		return new_path;
-	}
-
-	return NULL;
-}
-
-// get the directory where a program (with a specific pid) is located
-int get_program_directory(char* path,
-                          size_t size = PATH_MAX,
-                          pid_t pid = getpid())
-{
-	char sz_tmp[32];
-	char buf[size];
-	sprintf(sz_tmp, "/proc/%d/exe", pid);
-	ssize_t len = readlink(sz_tmp, buf, sizeof(buf)-1);
-	if (len == -1)
-		return len;
-	buf[len] = '\0';
-	// find last occurence of '/' to get obtain the path
-	char* ch = strrchr(buf, '/');
-	// set end marker to the new position
-	buf[ch-buf] = '\0';
-	strcpy(path, buf);
-	return 0;
+	if (*end && strcmp(end, "B") && strcmp(end, "b"))
+		return false;
+	size = value;
+	return true;
 }
 
-// get the directory where the current program is located
-std::string get_selfpath()
+// parse compression settings like LZ4:4 or ZSTD:5, the level is optional, returns false if they are invalid
+bool parse_compression(const char* str, int& settings)
 {
-	char buf[PATH_MAX];
-	ssize_t len = readlink("/proc/self/exe", buf, sizeof(buf)-1);
-	if (len != -1) {
-		buf[len] = '\0';
-		std::string str(buf);
-		// remove program name from path
-		str = get_base_name(str);
-		return str;
-	} else {
-		std::cerr << "Overflow by reading program path (off-by-one underflow)"
-		<< std::endl;
-		exit(EXIT_FAILURE);
+	static const char* algorithms[] = {"ZLIB", "LZMA", "", "LZ4", "ZSTD"};  // ROOT's numbering starts at 1
+	std::string name(str);
+	int level = 5;
+	const size_t colon = name.find(':');
+	if (colon != std::string::npos) {
+		std::string level_str = name.substr(colon + 1);
+		if (!is_udec(&level_str[0]) || (level = atoi(level_str.c_str())) > 9)
+			return false;
+		name.erase(colon);
 	}
-}
-
-// check if a file exists by opening and closing it
-int check_file(const char* name)
-{
-	FILE *f = NULL;
-	f = fopen(name, "r");
-	if (!f)
-		return 0;
-	fclose(f);
-	return 1;
-}
-
-// read recursively ROOT collections to get specific class types and add them to a given list
-template <typename T>
-void get_list_of(std::list<T*>& list, const TCollection* coll, const TClass* clas)
-{
-	TObject* obj;
-	TIter next(coll);
-	while ((obj = next())/* && obj->IsA()->HasDictionary()*/) {
-		if (obj->IsA()->InheritsFrom(clas))
-			list.push_back(dynamic_cast<T*>(obj));
-		else if (obj->IsA()->InheritsFrom(TDirectory::Class())) {
-			TDirectory* subdir = static_cast<TDirectory*>(obj);
-			subdir->ReadAll();  // read directory to get useful lists
-			get_list_of(list, subdir->GetList(), clas);
+	for (size_t i = 0; i < sizeof(algorithms)/sizeof(algorithms[0]); i++)
+		if (algorithms[i][0] && !strcasecmp(name.c_str(), algorithms[i])) {
+			settings = (i + 1)*100 + level;
+			return true;
 		}
-	}
+	return false;
 }
 
-void get_list_of_directories(std::list<TDirectory*>& list, const TCollection* coll)
+// check if a name given with -p is a regular expression ("re:...") or a glob pattern
+bool is_pattern(const std::string& name)
 {
-	get_list_of(list, coll, TDirectory::Class());
+	return !name.compare(0, 3, "re:") || name.find_first_of("*?[") != std::string::npos;
 }
 
-void get_list_of_histograms(std::list<TH1*>& list, const TCollection* coll)
+// stop watching on SIGINT or SIGTERM, the files found so far are merged and written
+void request_stop(int)
 {
-	get_list_of(list, coll, TH1::Class());
+	HistogramMerger::stop();
 }
 
 int main(int argc, char** argv)
 {
-	// the extension of the files which should be used
-	const char ext[8] = ".root";
 	// variables needed for the argument parsing
 	opterr = 0;  // use own error messages instead of getopt buildin ones
 	int opt;
@@ -366,13 +276,13 @@ int main(int argc, char** argv)
 	char path[PATH_MAX+1] = "";
 	bool merge_all = false;
 	std::vector<std::string> histograms;
-	std::list<std::string> files;
+	HistogramMerger::Options options;
 
 	/*
 	 * POSIX: if the first letter of the optstring is a colon, a colon is returned if an argument is missing, otherwise a questionmark
 	 * A -- will terminate the while loop, './program -- abc' won't process the other arguments
 	 */
-	while ((opt = getopt_long(argc, argv, "ho:p:d:i:", long_options, &option_index)) != -1) {
+	while ((opt = getopt_long(argc, argv, "ho:p:d:i:j:m:", long_options, &option_index)) != -1) {
 		switch (opt) {
 			case 0:
 				/* If this option sets a flag, do nothing else now. */
@@ -392,13 +302,14 @@ int main(int argc, char** argv)
 					fprintf(stderr, "Invalid parameters: only one file allowed as an argument\n");
 					return EXIT_FAILURE;
 				}
-				f = fopen(optarg, "r");
+				f = strcmp(optarg, "-") ? fopen(optarg, "r") : stdin;
 				if (!f) {
 					fprintf(stderr, "Error opening file %s: %s\n", optarg, strerror(errno));
 					return EXIT_FAILURE;
 				}
 				strcpy(input, optarg);
-				fclose(f);
+				if (f != stdin)
+					fclose(f);
 				f = NULL;  // set the pointer to NULL, otherwise a check for it will return true and closing the already closed file will cause undefined behaviour --> probably segfault
 				break;
 			case 'd':
@@ -413,10 +324,82 @@ int main(int argc, char** argv)
 					return EXIT_FAILURE;
 				}
 				strcpy(path, optarg);
-				remove_trailing_slash(path);
 				closedir(d);
 				d = NULL;
 				break;
+			case 'j':
+				if (!is_udec(optarg) || !atoi(optarg)) {
+					fprintf(stderr, "Invalid parameters: the number of jobs has to be a positive integer\n");
+					return EXIT_FAILURE;
+				}
+				options.jobs = atoi(optarg);
+				break;
+			case OPT_PROCS:
+				if (!is_udec(optarg) || !atoi(optarg)) {
+					fprintf(stderr, "Invalid parameters: the number of processes has to be a positive integer\n");
+					return EXIT_FAILURE;
+				}
+				options.procs = atoi(optarg);
+				break;
+			case OPT_COMPRESSION:
+				if (!parse_compression(optarg, options.compression)) {
+					fprintf(stderr, "Invalid parameters: '%s' is no valid compression, use e. g. LZ4:4 or ZSTD:5\n", optarg);
+					return EXIT_FAILURE;
+				}
+				break;
+			case OPT_SPARSE:
+				options.sparse_ratio = atof(optarg);
+				if (options.sparse_ratio <= 0 || options.sparse_ratio > 1) {
+					fprintf(stderr, "Invalid parameters: the fill ratio for sparse histograms has to be in (0, 1]\n");
+					return EXIT_FAILURE;
+				}
+				break;
+			case OPT_WEIGHTS:
+				options.weights_file = optarg;
+				break;
+			case OPT_GROUP_REGEX:
+				options.group_regex = optarg;
+				break;
+			case OPT_QUARANTINE:
+				options.quarantine_file = optarg;
+				break;
+			case OPT_STATS:
+				options.stats_file = optarg;
+				break;
+			case OPT_PREFETCH:
+				if (!is_udec(optarg)) {
+					fprintf(stderr, "Invalid parameters: the number of prefetched files has to be a non-negative integer\n");
+					return EXIT_FAILURE;
+				}
+				options.prefetch = atoi(optarg);
+				break;
+			case OPT_CHECKPOINT:
+				if (!is_udec(optarg) || !atoi(optarg)) {
+					fprintf(stderr, "Invalid parameters: the checkpoint interval has to be a positive number of files\n");
+					return EXIT_FAILURE;
+				}
+				options.checkpoint_files = atoi(optarg);
+				break;
+			case OPT_CHECKPOINT_INTERVAL:
+				options.checkpoint_seconds = atof(optarg);
+				if (options.checkpoint_seconds <= 0) {
+					fprintf(stderr, "Invalid parameters: the checkpoint interval has to be a positive number of seconds\n");
+					return EXIT_FAILURE;
+				}
+				break;
+			case OPT_WATCH_INTERVAL:
+				options.watch_seconds = atof(optarg);
+				if (options.watch_seconds <= 0) {
+					fprintf(stderr, "Invalid parameters: the watch interval has to be a positive number of seconds\n");
+					return EXIT_FAILURE;
+				}
+				break;
+			case 'm':
+				if (!parse_size(optarg, options.max_memory) || !options.max_memory) {
+					fprintf(stderr, "Invalid parameters: '%s' is not a valid memory size\n", optarg);
+					return EXIT_FAILURE;
+				}
+				break;
 			case 'h':
 				print_help(argv[0]);
 				return EXIT_SUCCESS;
@@ -432,9 +415,8 @@ int main(int argc, char** argv)
 		}
 	}
 
-	if (!merge_all)
-		for (int i = optind; i < argc; i++)
-			histograms.push_back(std::string(argv[i]));
+	for (int i = optind; i < argc; i++)
+		histograms.push_back(std::string(argv[i]));
 
 	if (!input[0] && !path[0]) {
 		fprintf(stderr, "You've specified neither a file nor a directory as input!\n");
@@ -444,203 +426,40 @@ int main(int argc, char** argv)
 		return EXIT_FAILURE;
 	}
 
-	if (verbose_flag)
-		std::cout << "verbose flag is set\nAdditional information will be printed" << std::endl;
-
-	// if path is specified, read in all root files which are stored in this directory
-	if (path[0]) {
-		// get a list of all files
-		list_files(path, files);
-		if (files.empty()) {
-			fprintf(stderr, "Directory '%s' doesn't contain any files!\n", path);
-			return EXIT_FAILURE;
-		}
-
-		// filter the list for root files
-		filter_list(files, ext);
-		if (files.empty()) {
-			fprintf(stderr, "Directory '%s' doesn't contain any %s-files!\n", path, ext);
-			return EXIT_FAILURE;
-		}
-	} else if (input[0]) {  // else input has to be specified, read the list and filter if necessary
-		std::ifstream in(input);
-		std::string line;
-		// paths to find the given root files in case of relative paths
-		char cwd[PATH_MAX];
-		getcwd(cwd, PATH_MAX-1);
-		std::string program_path = get_selfpath();
-		while (std::getline(in, line)) {
-			line = trim(line);
-			// skip empty lines or lines which start with a hash
-			if (line.empty() || line.find("#") == 0)
-				continue;
-			// check if the string contains the desired extension, skip if not
-			if (!strstr(line.c_str(), ext))
-				continue;
-			// try to find the files
-			if (check_file(line.c_str()))
-				files.push_back(line);
-			else if (check_file(join_path(cwd, line.c_str())))
-				files.push_back(std::string(join_path(cwd, line.c_str())));
-			else if (check_file(join_path(program_path, line)))
-				files.push_back(std::string(join_path_str(program_path, line)));
-			else
-				printf("WARNING: Couldn't find file '%s', skip it\n", line.c_str());
-		}
-		in.close();
-	} else {  // this case should never happen
-		std::cerr << "No source to obtain list of files existing, this shouldn't happen!" << std::endl;
-		return EXIT_FAILURE;
-	}
-
-	std::cout << "The following files will be merged:" << std::endl;
-	for (auto it : files)
-		std::cout << it << std::endl;
-	putchar('\n');
-
-	if (merge_all && verbose_flag)
-		std::cout << "All histograms from the files will be read in and merged" << std::endl;
-
-	/* start of the ROOT related code */
-
-	TFile* file;
-	TDirectory* dir;
-	std::vector<TH1*> merged_histograms;
-	// if all histograms should be merged, open the first file to get a list of all histograms
-	if (merge_all) {
-		file = TFile::Open(files.front().c_str());
-		if (!file->IsOpen()) {
-			std::cerr << "Unable to open file '" << file->GetName() << "'. Will terminate." << std::endl;
-			return EXIT_FAILURE;
-		}
-		// check if there is more than one directory in the file
-		std::list<TDirectory*> dirs;
-		// use ReadAll() to read the contents of the file in order that GetList returns a non-empty list
-		// if the file contains own classes without a dictionary, it is likely a std::bad_alloc exception is thrown
-		// in this case use GetListOfKeys() to read in file contents, which works in this case
-		// use a bool to indicate this and use the list of keys in this case
-		bool excpt = false;
-		try {
-			file->ReadAll();
-		} catch (std::exception const& ex) {
-			std::cout << "Exception thrown: " << ex.what() << std::endl;
-			std::cout << "******************************************************" << std::endl;
-			std::cout << "*                                                    *" << std::endl;
-			std::cout << "*  WARNING: If the files contain other objects than  *" << std::endl;
-			std::cout << "*           the usual ROOT classes like TH1D, make   *" << std::endl;
-			std::cout << "*           sure you specify explicitely only known  *" << std::endl;
-			std::cout << "*           class types or link the corresponding    *" << std::endl;
-			std::cout << "*           libraries during compilation, otherwise  *" << std::endl;
-			std::cout << "*           the program might crash while working    *" << std::endl;
-			std::cout << "*           with unknown classes                     *" << std::endl;
-			std::cout << "*                                                    *" << std::endl;
-			std::cout << "******************************************************" << std::endl;
-			file->GetListOfKeys();
-			excpt = true;
-		}
-		get_list_of_directories(dirs, excpt ? file->GetListOfKeys() : file->GetList());
-		if (dirs.empty() && !file->GetListOfKeys()->GetSize()) {
-			std::cerr << "The file '" << file->GetName() << "' seems to be empty. Will terminate." << std::endl;
-			file->Close();
-			return EXIT_FAILURE;
-		}
-		bool only_first_dir = false;
-		if (dirs.size() > 1) {
-			std::cout << "Found more than one directory in file " << file->GetName() << "." << std::endl;
-			std::cout << "Could use only the first directory or all of them." << std::endl;
-			std::cout << "What should be done? Use all directories? [y/n]: ";
-			unsigned int i = 0;
-			char response[8];
-			while (1) {
-				std::cin >> response;
-				if (!strcmp(response, "n") || !strcmp(response, "N") || !strcmp(response, "no")) {
-					only_first_dir = true;
-					break;
-				} else if (!strcmp(response, "y") || !strcmp(response, "Y") || !strcmp(response, "yes"))
-					break;
-				if (++i < 3)
-					std::cout << "Couldn't understand your input, please try again [y/n]: ";
-				else {
-					std::cout << "Sorry, no more tries, will use all directories" << std::endl;
-					break;
-				}
-			}
-			if (only_first_dir)
-				std::cout << "Will only take the first directory into account to collect histograms" << std::endl;
-			else {
-				// read in all histograms from the ROOT file
-				std::list<TH1*> hists;
-				get_list_of_histograms(hists, file->GetList());
-				std::for_each(hists.begin(), hists.end(), [&histograms](TH1* h){ histograms.push_back(std::string(h->GetName())); });
-			}
-		}
-		if (dirs.size() <= 1) {
-			if (dirs.size() == 1 || only_first_dir)  // only use the first directory to collect histograms
-				dir = file->GetDirectory(dirs.front()->GetName());
-			else  // no directory, use key list to obtain histograms
-				dir = file;  // TFile inherits from TDirectory, hance file can be assigned to dir in order to use the same structure below for both cases
-			TIter iter(dir->GetListOfKeys());
-			std::for_each(iter.Begin(), TIter::End(), [&histograms](TObject* o){ histograms.push_back(std::string(o->GetName())); });
-			if (verbose_flag) {
-				auto list_infos = [](TObject* o)
-					{
-						std::cout << "Class: "
-							<< o->IsA()->GetName()
-							<< ",\tName: "
-							<< o->GetName()
-							<< ",\tTitle: "
-							<< o->GetTitle()
-							<< std::endl;
-					};
-				std::cout << "The following histograms are stored in the file:" << std::endl;
-				std::for_each(iter.Begin(), TIter::End(), list_infos);
-				putchar('\n');
-			}
-		}
-		file->Close();
-	}
-
-	std::cout << "The following " << histograms.size() << " histograms will be considered:" << std::endl;
-	for (auto && str : histograms)
-		printf("   %s\n", str.c_str());
-
-	for (auto it : files) {
-		file = TFile::Open(it.c_str());
-		if (!file->IsOpen()) {
-			std::cerr << "Unable to open file '" << file->GetName() << "'. It will be skipped." << std::endl;
+	options.verbose = verbose_flag;
+	options.resume = resume_flag;
+	options.incremental = incremental_flag;
+	options.watch = watch_flag;
+	options.first_directory = first_directory_flag;
+	options.raw = raw_flag;
+	options.partial = partial_flag;
+	options.reduce = reduce_flag;
+	options.trees = trees_flag;
+	options.group_column = group_column_flag;
+	options.group_total = group_total_flag;
+
+	HistogramMerger merger(options);
+	if (path[0])  // if path is specified, read in all root files which are stored in this directory
+		merger.add_directory(path);
+	else  // else input has to be specified, read the list
+		merger.add_list(input);
+	if (merge_all)
+		merger.select_all();
+	// exclusions start with '!', they also apply to all
+	for (auto& name : histograms)
+		if (name[0] == '!')
+			merger.exclude(name.substr(1));
+		else if (merge_all)
 			continue;
-		}
-		if (!file->GetListOfKeys()->GetSize()) {
-			std::cerr << "The file '" << file->GetName() << "' seems to be empty. Skip this file." << std::endl;
-			file->Close();
-			continue;
-		}
-		if (merged_histograms.empty())
-			for (auto && name : histograms) {
-				TH1* h = dynamic_cast<TH1*>(file->FindObjectAny(name.c_str()));
-				h->SetDirectory(0);  // revoke gDirectory object ownership that this histogram won't get deleted when the file or directory is closed
-				merged_histograms.push_back(h);
-			}
+		else if (is_pattern(name))
+			merger.select_matching(name);
 		else
-			for (auto hist : merged_histograms) {
-				TH1* h = dynamic_cast<TH1*>(file->FindObjectAny(hist->GetName()));
-				if (!h) {
-					std::cerr << "Histogram " << hist->GetName() << " not found in file " << file->GetName() << ". Skipt it." << std::endl;
-					continue;
-				}
-				hist->Add(h);
-			}
-		file->Close();
-	}
-
-	file = TFile::Open(output, "RECREATE");
-	for (auto hist : merged_histograms)
-		hist->Write();
-	file->Close();
+			merger.select(name);
 
-	for (auto hist : merged_histograms)
-		delete hist;
+	if (watch_flag) {
+		signal(SIGINT, request_stop);
+		signal(SIGTERM, request_stop);
+	}
 
-	return EXIT_SUCCESS;
+	return merger.merge(output) ? EXIT_SUCCESS : EXIT_FAILURE;
 }
-